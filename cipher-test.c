@@ -21,13 +21,178 @@
 
 #include "worker.h"
 #include "ciphers.h"
+#include "scatter.h"
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 static work_order wo;
 static work_results wr;
 
+/* FNV-1a hashes of the histogram for keys 1000 through 1036 over the
+   first KEYSTREAM_GRANULE bytes of keystream, as computed by the
+   original one-key-at-a-time worker (ChaCha20 by the first worker
+   to support it).  Every other check below compares two worker
+   paths with each other; this one catches a change common to all of
+   them, such as deriving different keys.  */
+static const struct
+{
+    const char *name;
+    uint64_t hash;
+}
+golden[] = {
+    { "aes128",       0x24c4b040535298d9ull },
+    { "aes256",       0x1b6b9d8f9cb58585ull },
+    { "arc4",         0x02c37d6e3655db85ull },
+    { "chacha20_128", 0xfb4e685516215939ull },
+    { "chacha20_256", 0x4b99bba2dce08c8full },
+    { "isaac64",      0xccaccbb747e935d9ull },
+    { "salsa20_128",  0x63ce9df27f0eca2full },
+    { "salsa20_256",  0x14d089529a4975b5ull },
+};
+
+static uint64_t
+hash_results(const work_results *res)
+{
+    uint64_t h = 14695981039346656037ull;
+    size_t i, j;
+
+    for (i = 0; i < res->length; i++)
+        for (j = 0; j < 256; j++)
+        {
+            h ^= res->epmf[i][j];
+            h *= 1099511628211ull;
+        }
+    return h;
+}
+
+/* Check the plain and pipelined workers against the table above,
+   and that an empty work order gives an empty histogram.  Returns -1
+   if the cipher isn't in the table.  */
+static int
+check_golden(int cipher_index)
+{
+    work_results res;
+    size_t g, i, j;
+    int rv, pipelined;
+
+    for (g = 0; g < sizeof golden / sizeof golden[0]; g++)
+        if (!strcmp(golden[g].name, all_ciphers[cipher_index]->name))
+            break;
+    if (g == sizeof golden / sizeof golden[0])
+        return -1;
+
+    wo.base  = 1000;
+    wo.limit = 1037;
+    wo.length = KEYSTREAM_GRANULE;
+    wo.nonces = 1;
+    wo.cipher_index = cipher_index;
+
+    work_results_alloc(&res, wo.length);
+    worker_run(&wo, &res);
+    rv = hash_results(&res) != golden[g].hash;
+    if (!rv)
+    {
+        worker_run_pipelined(&wo, &res, 2, 3);
+        rv = hash_results(&res) != golden[g].hash;
+    }
+
+    wo.limit = wo.base;
+    for (pipelined = 0; !rv && pipelined < 2; pipelined++)
+    {
+        memset(res.epmf, 0xFF, res.length * sizeof *res.epmf);
+        if (pipelined)
+            worker_run_pipelined(&wo, &res, 2, 3);
+        else
+            worker_run(&wo, &res);
+        for (i = 0; !rv && i < res.length; i++)
+            for (j = 0; !rv && j < 256; j++)
+                rv = res.epmf[i][j] != 0;
+    }
+    work_results_free(&res);
+    return rv;
+}
+
+/* Check that the pipelined worker produces exactly the same histogram
+   as the plain one, over enough keys to force several spills of the
+   narrow counters and a short final batch.  */
+static int
+check_pipeline(int cipher_index)
+{
+    work_results plain, piped;
+    int rv;
+
+    wo.base  = 7;
+    wo.limit = 1007;
+    wo.length = 4 * KEYSTREAM_GRANULE;
+    wo.nonces = 1;
+    wo.cipher_index = cipher_index;
+
+    work_results_alloc(&plain, wo.length);
+    work_results_alloc(&piped, wo.length);
+    worker_run(&wo, &plain);
+    worker_run_pipelined(&wo, &piped, 2, 3);
+    rv = memcmp(plain.epmf, piped.epmf, wo.length * sizeof *plain.epmf);
+    work_results_free(&piped);
+    work_results_free(&plain);
+    return rv;
+}
+
+/* The same, with keys in families sharing all but their last byte,
+   which the work order cuts across.  */
+static int
+check_families(int cipher_index)
+{
+    int rv;
+
+    wo.key_suffix = 1;
+    rv = check_pipeline(cipher_index);
+    wo.key_suffix = 0;
+    return rv;
+}
+
+/* Check that a window of keystream starting partway in, far enough
+   that ISAAC64 has to discard a whole page, counts the same bytes as
+   the corresponding rows of a window starting at zero, with both the
+   plain and the pipelined worker.  */
+static int
+check_window(int cipher_index)
+{
+    const uint64_t offset = 17 * KEYSTREAM_GRANULE + 37;
+    work_results whole, plain, piped;
+    int rv;
+
+    wo.base  = 7;
+    wo.limit = 1007;
+    wo.nonces = 1;
+    wo.cipher_index = cipher_index;
+
+    wo.offset = 0;
+    wo.length = 20 * KEYSTREAM_GRANULE;
+    work_results_alloc(&whole, wo.length);
+    worker_run(&wo, &whole);
+
+    wo.offset = offset;
+    wo.length = 2 * KEYSTREAM_GRANULE;
+    work_results_alloc(&plain, wo.length);
+    work_results_alloc(&piped, wo.length);
+    worker_run(&wo, &plain);
+    worker_run_pipelined(&wo, &piped, 2, 3);
+
+    rv = memcmp(whole.epmf + offset, plain.epmf,
+                wo.length * sizeof *plain.epmf);
+    if (!rv)
+        rv = memcmp(plain.epmf, piped.epmf, wo.length * sizeof *plain.epmf);
+    wo.offset = 0;
+    work_results_free(&piped);
+    work_results_free(&plain);
+    work_results_free(&whole);
+    return rv;
+}
+
 static inline double
 timedelta_ns(const struct timespec *end,
              const struct timespec *start)
@@ -40,13 +205,293 @@ timedelta_ns(const struct timespec *end,
     return delta_ns * 1e-9 + delta_s;
 }
 
-int
-main(void)
+/* Check that the pipelined worker also agrees with the plain one
+   when each key is swept across several nonces, and report how much
+   faster per sample that is than taking the same number of samples
+   from fresh keys.  The keystream is short, which is where key setup
+   costs the most.  */
+static int
+check_sweep(int cipher_index)
+{
+    work_results fresh, swept, piped;
+    struct timespec t0, t1, t2;
+    int rv;
+
+    wo.base  = 7;
+    wo.length = KEYSTREAM_GRANULE;
+    wo.cipher_index = cipher_index;
+
+    work_results_alloc(&fresh, wo.length);
+    work_results_alloc(&swept, wo.length);
+    work_results_alloc(&piped, wo.length);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    wo.limit = 4007;
+    wo.nonces = 1;
+    worker_run(&wo, &fresh);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    wo.limit = 1007;
+    wo.nonces = 4;
+    worker_run(&wo, &swept);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    worker_run_pipelined(&wo, &piped, 2, 3);
+
+    rv = memcmp(swept.epmf, piped.epmf, wo.length * sizeof *swept.epmf);
+    if (!rv)
+        fprintf(stderr, "ok (%.2fx) ",
+                timedelta_ns(&t1, &t0) / timedelta_ns(&t2, &t1));
+    work_results_free(&piped);
+    work_results_free(&swept);
+    work_results_free(&fresh);
+    return rv;
+}
+
+/* Run every scatter kernel the CPU supports over the same work order
+   for one cipher, check that they agree, and report each one's speed
+   relative to the scalar kernel.  */
+static int
+bench_scatter(int cipher_index)
+{
+    const scatter_kernel *chosen = scatter_select(), *k;
+    struct timespec start, stop;
+    work_results first;
+    double rate, scalar_rate = 0;
+    int rv = 0;
+
+    wo.base  = 0;
+    wo.limit = 500;
+    wo.length = DEFAULT_KEYSTREAM_LENGTH;
+    wo.nonces = 1;
+    wo.cipher_index = cipher_index;
+    work_results_alloc(&first, wo.length);
+
+    for (k = scatter_kernels; k->name; k++)
+    {
+        if (!k->supported())
+            continue;
+        scatter_current = k;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        worker_run(&wo, &wr);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        rate = (wo.limit - wo.base) / timedelta_ns(&stop, &start);
+
+        if (k == scatter_kernels)
+        {
+            scalar_rate = rate;
+            memcpy(first.epmf, wr.epmf, wo.length * sizeof *wr.epmf);
+        }
+        else if (memcmp(first.epmf, wr.epmf, wo.length * sizeof *wr.epmf))
+        {
+            fprintf(stderr, "%s FAIL ", k->name);
+            rv = 1;
+            continue;
+        }
+        fprintf(stderr, "%s%s %.1f/s (%.2fx) ", k->name,
+                k == chosen ? "*" : "", rate, rate / scalar_rate);
+    }
+    putc('\n', stderr);
+
+    scatter_current = chosen;
+    work_results_free(&first);
+    return rv;
+}
+
+/* The worker asks for keystream for this many contexts, and this
+   many bytes of each, at a time.  */
+#define BATCH_KEYS 32
+#define BATCH_TILE 256
+
+/* Check a cipher's own gen_keystream_batch against generating each
+   context's keystream on its own and transposing it, which is what
+   the worker does for a cipher without one, over the whole default
+   keystream length in calls of the size the worker makes.  Report
+   how much faster it is.  */
+static int
+check_batch(int cipher_index)
+{
+    const cipher *ciph = all_ciphers[cipher_index];
+    uint8_t got[BATCH_KEYS * BATCH_TILE], exp[BATCH_KEYS * BATCH_TILE];
+    uint8_t block[BATCH_TILE];
+    uint8_t *keys, *batch_ctx, *each_ctx;
+    struct timespec t0, t1;
+    double batch_time = 0, each_time = 0;
+    size_t offset, i, k;
+    int rv = 0;
+
+    keys = malloc(BATCH_KEYS * ciph->keysize);
+    batch_ctx = malloc(BATCH_KEYS * ciph->ctxsize);
+    each_ctx = malloc(BATCH_KEYS * ciph->ctxsize);
+    if (!keys || !batch_ctx || !each_ctx)
+        abort();
+
+    for (i = 0; i < BATCH_KEYS * ciph->keysize; i++)
+        keys[i] = (uint8_t)(i * 7 + 1);
+    cipher_init_batch(ciph, batch_ctx, keys, BATCH_KEYS);
+    for (k = 0; k < BATCH_KEYS; k++)
+        ciph->init(each_ctx + k * ciph->ctxsize, keys + k * ciph->keysize);
+
+    for (offset = 0; offset < DEFAULT_KEYSTREAM_LENGTH && !rv;
+         offset += BATCH_TILE)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ciph->gen_keystream_batch(batch_ctx, BATCH_KEYS, offset,
+                                  got, BATCH_TILE);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        batch_time += timedelta_ns(&t1, &t0);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (k = 0; k < BATCH_KEYS; k++)
+        {
+            ciph->gen_keystream(each_ctx + k * ciph->ctxsize, offset,
+                                block, BATCH_TILE);
+            for (i = 0; i < BATCH_TILE; i++)
+                exp[i * BATCH_KEYS + k] = block[i];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        each_time += timedelta_ns(&t1, &t0);
+
+        rv = memcmp(got, exp, sizeof got);
+    }
+
+    if (!rv)
+        fprintf(stderr, "%.2fx ", each_time / batch_time);
+    free(keys);
+    free(batch_ctx);
+    free(each_ctx);
+    return rv;
+}
+
+/* Time every implementation of a cipher that this CPU can run, on the
+   same keys in the worker's batches and tiles, check that they agree,
+   and report each one's speed relative to the slowest.  The one
+   marked with a star is the cipher's default, which should be the
+   fastest.  The implementations take turns one tile at a time, so a
+   change in the machine's speed during the run affects them all
+   alike, and each one's best of BENCH_RUNS runs is kept, which
+   leaves out most runs that were interrupted.  */
+#define BENCH_RUNS 3
+
+static int
+bench_impls(int cipher_index)
+{
+    const cipher *ciph = all_ciphers[cipher_index];
+    const char *chosen = ciph->current_impl();
+    uint8_t got[BATCH_KEYS * BATCH_TILE], exp[BATCH_KEYS * BATCH_TILE];
+    uint8_t *keys, *ctxs;
+    struct timespec t0, t1;
+    double *elapsed, *best, slowest = 0;
+    bool *usable;
+    size_t nimpls, offset, i, j, run;
+    int rv = 0;
+
+    for (nimpls = 0; ciph->impls[nimpls]; nimpls++)
+        ;
+    keys = malloc(BATCH_KEYS * ciph->keysize);
+    ctxs = malloc(nimpls * BATCH_KEYS * ciph->ctxsize);
+    elapsed = malloc(nimpls * sizeof *elapsed);
+    best = malloc(nimpls * sizeof *best);
+    usable = malloc(nimpls * sizeof *usable);
+    if (!keys || !ctxs || !elapsed || !best || !usable)
+        abort();
+
+    for (i = 0; i < BATCH_KEYS * ciph->keysize; i++)
+        keys[i] = (uint8_t)(i * 7 + 1);
+
+    for (run = 0; run < BENCH_RUNS && !rv; run++)
+    {
+        /* Not every cipher can go back to the start of its keystream,
+           so set the keys up again for each run.  */
+        for (j = 0; j < nimpls; j++)
+        {
+            usable[j] = ciph->use_impl(ciph->impls[j]);
+            if (usable[j])
+                cipher_init_batch(ciph,
+                                  ctxs + j * BATCH_KEYS * ciph->ctxsize,
+                                  keys, BATCH_KEYS);
+            elapsed[j] = 0;
+        }
+        ciph->use_impl(0);
+
+        for (offset = 0; offset < DEFAULT_KEYSTREAM_LENGTH && !rv;
+             offset += BATCH_TILE)
+            for (j = 0; j < nimpls && !rv; j++)
+            {
+                if (!usable[j])
+                    continue;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                cipher_gen_keystream_batch(ciph, ctxs + j * BATCH_KEYS
+                                           * ciph->ctxsize, BATCH_KEYS,
+                                           offset, got, BATCH_TILE);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                elapsed[j] += timedelta_ns(&t1, &t0);
+
+                if (j == 0 || !usable[0])
+                    memcpy(exp, got, sizeof got);
+                else if (memcmp(got, exp, sizeof got))
+                {
+                    fprintf(stderr, "%s FAIL ", ciph->impls[j]);
+                    rv = 1;
+                }
+            }
+
+        for (j = 0; j < nimpls; j++)
+            if (run == 0 || elapsed[j] < best[j])
+                best[j] = elapsed[j];
+    }
+
+    if (!rv)
+    {
+        for (j = 0; j < nimpls; j++)
+            if (usable[j] && best[j] > slowest)
+                slowest = best[j];
+        for (j = 0; j < nimpls; j++)
+            if (usable[j])
+                fprintf(stderr, "%s%s %.2fx ", ciph->impls[j],
+                        strcmp(ciph->impls[j], chosen) ? "" : "*",
+                        slowest / best[j]);
+    }
+
+    free(keys);
+    free(ctxs);
+    free(elapsed);
+    free(best);
+    free(usable);
+    return rv;
+}
+
+static void
+time_cipher(int cipher_index, const char *label)
 {
-    int i;
     struct timespec start, stop;
     double elapsed;
 
+    wo.base  = 0;
+    wo.limit = 2000;
+    wo.length = DEFAULT_KEYSTREAM_LENGTH;
+    wo.nonces = 1;
+    wo.cipher_index = cipher_index;
+
+    fprintf(stderr, "TIME: %11s... ", label);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    worker_run(&wo, &wr);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = timedelta_ns(&stop, &start);
+
+    fprintf(stderr,
+            "%zu keys, %9.5fs -> %8.3f keys/s\n",
+            wo.limit - wo.base,
+            elapsed,
+            (wo.limit - wo.base) / elapsed);
+}
+
+int
+main(void)
+{
+    int i, rv = 0;
+    const char *const *impl;
+    char label[64];
+
+    work_results_alloc(&wr, DEFAULT_KEYSTREAM_LENGTH);
+
     for (i = 0; all_ciphers[i]; i++)
     {
         fprintf(stderr, "KAT:  %11s... ", all_ciphers[i]->name);
@@ -56,23 +501,135 @@ main(void)
 
     for (i = 0; all_ciphers[i]; i++)
     {
-        wo.base  = 0;
-        wo.limit = 2000;
-        wo.cipher_index = i;
+        fprintf(stderr, "GOLD: %11s... ", all_ciphers[i]->name);
+        switch (check_golden(i))
+        {
+        case 0:
+            fputs("ok\n", stderr);
+            break;
+        case -1:
+            fputs("no reference\n", stderr);
+            break;
+        default:
+            fputs("FAIL\n", stderr);
+            return 1;
+        }
+    }
 
-        fprintf(stderr, "TIME: %11s... ", all_ciphers[i]->name);
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        worker_run(&wo, &wr);
-        clock_gettime(CLOCK_MONOTONIC, &stop);
-        elapsed = timedelta_ns(&stop, &start);
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        fprintf(stderr, "PIPE: %11s... ", all_ciphers[i]->name);
+        if (check_pipeline(i))
+        {
+            fputs("FAIL\n", stderr);
+            return 1;
+        }
+        fputs("ok\n", stderr);
+    }
+
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        fprintf(stderr, "FAMI: %11s... ", all_ciphers[i]->name);
+        if (check_families(i))
+        {
+            fputs("FAIL\n", stderr);
+            return 1;
+        }
+        fputs("ok\n", stderr);
+    }
+
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        fprintf(stderr, "WIND: %11s... ", all_ciphers[i]->name);
+        if (check_window(i))
+        {
+            fputs("FAIL\n", stderr);
+            return 1;
+        }
+        fputs("ok\n", stderr);
+    }
+
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        if (!all_ciphers[i]->set_nonce)
+            continue;
+        fprintf(stderr, "NONC: %11s... ", all_ciphers[i]->name);
+        if (check_sweep(i))
+        {
+            fputs("FAIL\n", stderr);
+            return 1;
+        }
+        putc('\n', stderr);
+    }
+
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        fprintf(stderr, "SCAT: %11s... ", all_ciphers[i]->name);
+        if (bench_scatter(i))
+            return 1;
+    }
+
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        if (!all_ciphers[i]->gen_keystream_batch)
+            continue;
+        fprintf(stderr, "BTCH: %11s... ", all_ciphers[i]->name);
+        if (!all_ciphers[i]->impls)
+            rv = check_batch(i);
+        else
+        {
+            /* With every implementation this CPU can run.  */
+            for (impl = all_ciphers[i]->impls; *impl && !rv; impl++)
+            {
+                if (!all_ciphers[i]->use_impl(*impl))
+                    continue;
+                fprintf(stderr, "%s ", *impl);
+                rv = check_batch(i);
+            }
+            all_ciphers[i]->use_impl(0);
+        }
+        if (rv)
+        {
+            fputs("FAIL\n", stderr);
+            return 1;
+        }
+        putc('\n', stderr);
+    }
+
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        if (!all_ciphers[i]->impls)
+            continue;
+        fprintf(stderr, "IMPL: %11s... ", all_ciphers[i]->name);
+        if (bench_impls(i))
+        {
+            fputs("\n", stderr);
+            return 1;
+        }
+        putc('\n', stderr);
+    }
+
+    for (i = 0; all_ciphers[i]; i++)
+    {
+        if (!all_ciphers[i]->impls)
+        {
+            time_cipher(i, all_ciphers[i]->name);
+            continue;
+        }
 
-        fprintf(stderr,
-                "%zu keys, %9.5fs -> %8.3f keys/s\n",
-                wo.limit - wo.base,
-                elapsed,
-                (wo.limit - wo.base) / elapsed);
+        /* Time every implementation this CPU can run.  */
+        for (impl = all_ciphers[i]->impls; *impl; impl++)
+        {
+            if (!all_ciphers[i]->use_impl(*impl))
+                continue;
+            snprintf(label, sizeof label, "%s/%s",
+                     all_ciphers[i]->name, *impl);
+            time_cipher(i, label);
+        }
+        all_ciphers[i]->use_impl(0);
     }
 
+    work_results_free(&wr);
     return 0;
 }
 
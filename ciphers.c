@@ -0,0 +1,229 @@
+/*  Cipher dispatch: generic implementations of optional operations.
+ *
+ *  Copyright (C) 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ciphers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+cipher_init_batch(const cipher *ciph, void *ctxs,
+                  const uint8_t *keys, size_t n)
+{
+    uint8_t *ctx = ctxs;
+    size_t k;
+
+    if (ciph->init_batch)
+    {
+        ciph->init_batch(ctxs, keys, n);
+        return;
+    }
+
+    for (k = 0; k < n; k++)
+        ciph->init(ctx + k * ciph->ctxsize, keys + k * ciph->keysize);
+}
+
+void
+cipher_init_batch_prefix(const cipher *ciph, void *ctxs,
+                         const uint8_t *keys, size_t n, size_t prefix)
+{
+    if (ciph->init_batch_prefix && prefix)
+        ciph->init_batch_prefix(ctxs, keys, n, prefix);
+    else
+        cipher_init_batch(ciph, ctxs, keys, n);
+}
+
+void
+cipher_gen_keystream_batch(const cipher *ciph,
+                           void *ctxs, size_t n, size_t offset,
+                           uint8_t *obuf, size_t olen)
+{
+    uint8_t *ctx = ctxs;
+    uint8_t block[256];
+    size_t i, k, chunk, done;
+
+    if (ciph->gen_keystream_batch)
+    {
+        ciph->gen_keystream_batch(ctxs, n, offset, obuf, olen);
+        return;
+    }
+
+    /* Generate each context's keystream a block at a time, and
+       transpose it into the output.  Each context is advanced
+       monotonically, so this is fine for non-seekable ciphers.  */
+    for (k = 0; k < n; k++)
+        for (done = 0; done < olen; done += chunk)
+        {
+            chunk = olen - done;
+            if (chunk > sizeof block)
+                chunk = sizeof block;
+
+            ciph->gen_keystream(ctx + k * ciph->ctxsize, offset + done,
+                                block, chunk);
+            for (i = 0; i < chunk; i++)
+                obuf[(done + i) * n + k] = block[i];
+        }
+}
+
+/* None of the ciphers with a nonce have init_batch, so their
+   contexts are always laid out one after another.  */
+void
+cipher_set_nonce_batch(const cipher *ciph, void *ctxs,
+                       size_t n, uint64_t nonce)
+{
+    uint8_t *ctx = ctxs;
+    size_t k;
+
+    if (!ciph->set_nonce || ciph->init_batch)
+        abort();
+
+    for (k = 0; k < n; k++)
+        ciph->set_nonce(ctx + k * ciph->ctxsize, nonce);
+}
+
+void
+cipher_ctr_gen_keystream(void (*gen_blocks)(void *, uint64_t,
+                                            size_t, uint8_t *),
+                         size_t blocksize, void *ctx, size_t offset,
+                         uint8_t *obuf, size_t olen)
+{
+    uint8_t block[CIPHER_MAX_BLOCKSIZE];
+    uint64_t first = offset / blocksize;
+    size_t skip = offset % blocksize, n;
+
+    if (olen == 0)
+        return;
+
+    if (skip)
+    {
+        gen_blocks(ctx, first, 1, block);
+        n = blocksize - skip;
+        if (n > olen)
+            n = olen;
+        memcpy(obuf, block + skip, n);
+        obuf += n;
+        olen -= n;
+        first++;
+    }
+
+    n = olen / blocksize;
+    gen_blocks(ctx, first, n, obuf);
+    obuf += blocksize * n;
+    olen -= blocksize * n;
+
+    if (olen)
+    {
+        gen_blocks(ctx, first + n, 1, block);
+        memcpy(obuf, block, olen);
+    }
+}
+
+/* Apply one item of a cipher_use_impls spec.  CNAME is null if the
+   item didn't name a cipher.  */
+static bool
+use_impl_item(const char *cname, const char *impl)
+{
+    const char *const *i;
+    const cipher *ciph;
+    bool matched = false, named = false;
+    size_t c;
+
+    for (c = 0; all_ciphers[c]; c++)
+    {
+        ciph = all_ciphers[c];
+        if (cname && strcmp(ciph->name, cname))
+            continue;
+        named = true;
+
+        i = ciph->impls;
+        while (i && *i && strcmp(*i, impl))
+            i++;
+        if (!i || !*i)
+        {
+            if (!cname)
+                continue;
+            fprintf(stderr, "cipher %s has no implementation named %s\n",
+                    cname, impl);
+            return false;
+        }
+
+        matched = true;
+        if (!ciph->use_impl(impl))
+        {
+            fprintf(stderr, "this CPU cannot run %s/%s\n",
+                    ciph->name, impl);
+            return false;
+        }
+    }
+
+    if (cname && !named)
+        fprintf(stderr, "unrecognized cipher: %s\n", cname);
+    else if (!matched)
+        fprintf(stderr, "no cipher has an implementation named %s\n",
+                impl);
+    return matched;
+}
+
+bool
+cipher_use_impls(const char *spec)
+{
+    char item[64], *eq;
+    size_t len;
+
+    for (; *spec; spec += len + (spec[len] == ','))
+    {
+        len = strcspn(spec, ",");
+        if (len == 0)
+            continue;
+        if (len >= sizeof item)
+        {
+            fprintf(stderr, "implementation spec item too long: %.*s\n",
+                    (int)len, spec);
+            return false;
+        }
+        memcpy(item, spec, len);
+        item[len] = '\0';
+
+        eq = strchr(item, '=');
+        if (eq)
+        {
+            *eq = '\0';
+            if (!use_impl_item(item, eq + 1))
+                return false;
+        }
+        else if (!use_impl_item(0, item))
+            return false;
+    }
+    return true;
+}
+
+const char *
+cipher_impl_name(const cipher *ciph)
+{
+    return ciph->current_impl ? ciph->current_impl() : "generic";
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
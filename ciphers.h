@@ -23,6 +23,7 @@
 #ifndef CIPHERS_H__
 #define CIPHERS_H__
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -54,6 +55,66 @@ typedef struct
     /* Perform some sort of self-test.  If it fails, print a descriptive
        message to stderr and crash.  Produce no output on success.  */
     void (*selftest)(void);
+
+    /* The remaining entry points are optional; use the cipher_*
+       wrappers below, which fall back to generic implementations
+       when a cipher doesn't provide them.  */
+
+    /* Counter-mode ciphers, whose keystream is a sequence of
+       independent blocks of BLOCKSIZE bytes, also provide it a whole
+       block at a time.  gen_blocks writes blocks BLOCK through
+       BLOCK+NBLOCKS-1, which are keystream bytes BLOCK*BLOCKSIZE
+       onward, to OBUF.  There is no per-byte bookkeeping, and any
+       block can be generated at any time, so callers that only ever
+       want whole blocks should use this.  For these ciphers
+       gen_keystream is just cipher_ctr_gen_keystream around
+       gen_blocks.  BLOCKSIZE is zero for other ciphers.  */
+    size_t blocksize;
+    void (*gen_blocks)(void *ctx, uint64_t block, size_t nblocks,
+                       uint8_t *obuf);
+
+    /* Ciphers that take a nonce or IV as well as a key provide
+       set_nonce, which changes the nonce of an initialized context
+       without redoing the key setup.  NONCE is a 64-bit integer;
+       each cipher's set_nonce says how it maps onto the cipher's own
+       nonce.  init leaves the nonce at zero.  */
+    void (*set_nonce)(void *ctx, uint64_t nonce);
+
+    /* Initialize N cipher contexts at once.  CTXS must point to
+       N*CTXSIZE bytes of storage, and KEYS must point to N*KEYSIZE
+       bytes of key material, with key K at KEYS + K*KEYSIZE.  The
+       layout of CTXS is private to the cipher; it may only be passed
+       to gen_keystream_batch, with the same N.  */
+    void (*init_batch)(void *ctxs, const uint8_t *keys, size_t n);
+
+    /* Like init_batch, but all N keys have the same first PREFIX
+       bytes, so whatever part of the key setup depends only on those
+       can be done once for the whole batch.  */
+    void (*init_batch_prefix)(void *ctxs, const uint8_t *keys, size_t n,
+                              size_t prefix);
+
+    /* Generate OLEN bytes of keystream, beginning at byte offset
+       OFFSET, from each of the N contexts in CTXS, into OBUF, which
+       is N*OLEN bytes long.  The output is position-major: byte
+       OFFSET+I of context K's keystream is written to OBUF[I*N + K].
+       The same seeking restrictions apply as for gen_keystream.  */
+    void (*gen_keystream_batch)(void *ctxs, size_t n, size_t offset,
+                                uint8_t *obuf, size_t olen);
+
+    /* Some ciphers have several interchangeable implementations, for
+       instance using different instruction set extensions.  IMPLS
+       lists their names in order of preference, terminated by a null
+       pointer.  use_impl(NAME) makes contexts initialized from then
+       on use implementation NAME, or the most preferred one this CPU
+       supports if NAME is null.  It returns false, and changes
+       nothing, if NAME is unknown or this CPU can't run it.  All
+       implementations produce the same keystream.  Ciphers that
+       share code, such as aes128 and aes256, share the choice.
+       current_impl() returns the name of the implementation a context
+       initialized now would use.  */
+    const char *const *impls;
+    bool (*use_impl)(const char *name);
+    const char *(*current_impl)(void);
 } cipher;
 
 /* The AES128 cipher dispatch table is special because it's used to
@@ -62,16 +123,78 @@ typedef struct
    random keys.  */
 extern const cipher aes128_cipher;
 
+/* Initialize CTX, of aes128_cipher.ctxsize bytes, as aes128_cipher's
+   init would, but always with the most preferred implementation this
+   CPU supports, regardless of use_impl.  Key derivation uses this, so
+   that choosing an AES implementation to test or time leaves every
+   cipher's key derivation alone.  */
+extern void aes128_keygen_init(void *ctx, const uint8_t *key);
+
 /* In general, ciphers are looked up by name in this table. */
 extern const cipher *all_ciphers[];
 
-/* This macro defines an entry in all_ciphers. */
-#define DEFINE_CIPHER(name, prefix, keysize)                    \
-    const cipher name##_cipher =                                \
-    { #name, sizeof(prefix##_context), keysize,                 \
-      name##_init,                                              \
-      prefix##_gen_keystream,                                   \
-      prefix##_selftest                                         \
+/* Batch operations; see above.  These use the cipher's own batch
+   entry points if it has them, and otherwise loop over init and
+   gen_keystream. */
+extern void cipher_init_batch(const cipher *ciph, void *ctxs,
+                              const uint8_t *keys, size_t n);
+extern void cipher_init_batch_prefix(const cipher *ciph, void *ctxs,
+                                     const uint8_t *keys, size_t n,
+                                     size_t prefix);
+extern void cipher_gen_keystream_batch(const cipher *ciph,
+                                       void *ctxs, size_t n, size_t offset,
+                                       uint8_t *obuf, size_t olen);
+
+/* Set the nonce of each of the N contexts in CTXS, as initialized by
+   cipher_init_batch, to NONCE.  The cipher must have a set_nonce
+   entry point.  */
+extern void cipher_set_nonce_batch(const cipher *ciph, void *ctxs,
+                                   size_t n, uint64_t nonce);
+
+/* gen_keystream for a counter-mode cipher, in terms of its
+   GEN_BLOCKS and BLOCKSIZE, which must be at most
+   CIPHER_MAX_BLOCKSIZE.  Only a partial block at either end of the
+   request goes through a bounce buffer; everything in between is
+   written by one call to GEN_BLOCKS.  */
+#define CIPHER_MAX_BLOCKSIZE 64
+extern void cipher_ctr_gen_keystream(void (*gen_blocks)(void *, uint64_t,
+                                                        size_t, uint8_t *),
+                                     size_t blocksize, void *ctx,
+                                     size_t offset,
+                                     uint8_t *obuf, size_t olen);
+
+/* Implementation selection.  Left alone, every cipher uses the most
+   preferred implementation the CPU supports, determined at run time,
+   so one binary runs at full speed on every machine.
+   cipher_use_impls overrides that according to SPEC, a
+   comma-separated list of CIPHER=IMPL items; an item that is just
+   IMPL applies to every cipher with an implementation of that name.
+   It returns false, after printing a message on stderr, if SPEC is
+   malformed or names an implementation this CPU can't run.  Earlier
+   items may already have taken effect by then.  */
+extern bool cipher_use_impls(const char *spec);
+
+/* The name of the implementation CIPH is using, for logging: the
+   result of current_impl, or "generic" for a cipher that has only
+   one implementation.  */
+extern const char *cipher_impl_name(const cipher *ciph);
+
+/* The environment variable consulted by programs that take a
+   cipher_use_impls spec, when it isn't given on the command line.  */
+#define CIPHER_IMPL_ENV "RNGSTATS_IMPL"
+
+/* This macro defines an entry in all_ciphers.  The arguments after
+   PREFIX are the key size, optionally followed by designated
+   initializers for any of the optional entry points, e.g.
+   DEFINE_CIPHER(foo, foo, 16, .init_batch = foo_init_batch).  */
+#define DEFINE_CIPHER(cname, prefix, ...)                       \
+    const cipher cname##_cipher =                               \
+    { .name          = #cname,                                  \
+      .ctxsize       = sizeof(prefix##_context),                \
+      .init          = cname##_init,                            \
+      .gen_keystream = prefix##_gen_keystream,                  \
+      .selftest      = prefix##_selftest,                       \
+      .keysize       = __VA_ARGS__                              \
     } /* deliberate absence of semicolon */
 
 #endif
@@ -0,0 +1,344 @@
+/*
+ *  Bitsliced AES kernel, instantiated by aes.c once per vector width.
+ *
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The includer defines BS_ISA (a suffix for the generated names),
+ * BS_TARGET (function attributes enabling the instruction set), and
+ * BS_WIDTH (bytes per vector register, 16 or 32).  This file defines
+ * aes_encrypt_bitslice_<BS_ISA> and aes_ctr_blocks_bitslice_<BS_ISA>,
+ * with the signatures of aes_backend's encrypt and ctr_blocks, and
+ * undefines the three parameters again.
+ *
+ * The state of BS_WIDTH/2 blocks is held as eight bit planes, one
+ * register each: plane I holds bit I of every byte of every block.
+ * Each 128-bit lane of a plane is laid out like an AES state, one
+ * byte per state position in column-major order, and bit B of that
+ * byte belongs to block B of the lane's eight blocks.  That makes
+ * ShiftRows a per-row rotation of 32-bit words, MixColumns rotations
+ * within words plus a renaming of planes, and SubBytes Boyar and
+ * Peralta's 113-gate circuit applied to the planes.  Nothing needs a
+ * byte shuffle, so plain SSE2 will do.
+ */
+
+#define BS_CAT_(a, b) a##_##b
+#define BS_CAT(a, b)  BS_CAT_(a, b)
+#define BS_FN(name)   BS_CAT(name, BS_ISA)
+#define BS_INLINE     static inline __attribute__((always_inline)) BS_TARGET
+#define BS_BLOCKS     (BS_WIDTH / 2)
+
+#define bs_word          BS_FN(bs_word)
+#define bs_index         BS_FN(bs_index)
+#define bs_transpose     BS_FN(bs_transpose)
+#define bs_bytes         BS_FN(bs_bytes)
+#define bs_round_keys    BS_FN(bs_round_keys)
+#define bs_slice_keys    BS_FN(bs_slice_keys)
+#define bs_add_round_key BS_FN(bs_add_round_key)
+#define bs_sub_bytes     BS_FN(bs_sub_bytes)
+#define bs_shift_rows    BS_FN(bs_shift_rows)
+#define bs_mix_columns   BS_FN(bs_mix_columns)
+#define bs_encrypt       BS_FN(bs_encrypt)
+
+typedef uint32_t bs_word __attribute__((vector_size(BS_WIDTH)));
+typedef int32_t bs_index __attribute__((vector_size(BS_WIDTH)));
+typedef uint8_t bs_bytes __attribute__((vector_size(BS_WIDTH)));
+typedef bs_word bs_round_keys[15][8];
+
+/* Exchange the bits of A selected by M << S with the bits of B
+   selected by M.  */
+#define BS_SWAPMOVE(a, b, s, m) do {            \
+        bs_word t_ = ((a >> s) ^ b) & (m);      \
+        b ^= t_;                                \
+        a ^= t_ << s;                           \
+    } while (0)
+
+/* Transpose each 8x8 bit matrix formed by byte K of all eight
+   registers.  This converts blocks into bitsliced form, and back
+   again.  */
+BS_INLINE void
+bs_transpose(bs_word x[8])
+{
+    BS_SWAPMOVE(x[0], x[1], 1, 0x55555555u);
+    BS_SWAPMOVE(x[2], x[3], 1, 0x55555555u);
+    BS_SWAPMOVE(x[4], x[5], 1, 0x55555555u);
+    BS_SWAPMOVE(x[6], x[7], 1, 0x55555555u);
+    BS_SWAPMOVE(x[0], x[2], 2, 0x33333333u);
+    BS_SWAPMOVE(x[1], x[3], 2, 0x33333333u);
+    BS_SWAPMOVE(x[4], x[6], 2, 0x33333333u);
+    BS_SWAPMOVE(x[5], x[7], 2, 0x33333333u);
+    BS_SWAPMOVE(x[0], x[4], 4, 0x0f0f0f0fu);
+    BS_SWAPMOVE(x[1], x[5], 4, 0x0f0f0f0fu);
+    BS_SWAPMOVE(x[2], x[6], 4, 0x0f0f0f0fu);
+    BS_SWAPMOVE(x[3], x[7], 4, 0x0f0f0f0fu);
+}
+
+#undef BS_SWAPMOVE
+
+/* Slice CTX's round keys: byte K of plane I of round key R is all
+   ones if bit I of byte K of the round key is set, with the key
+   repeated in every 128-bit lane.  This is done on each call rather
+   than kept in the context, so that the other backends don't carry
+   it around; it costs one comparison per plane.  */
+BS_TARGET static void
+bs_slice_keys(const aes_context *ctx, bs_round_keys rk)
+{
+    uint8_t b[BS_WIDTH];
+    bs_bytes v;
+    int r, i, k;
+
+    for (r = 0; r <= ctx->nr; r++)
+    {
+        for (k = 0; k < BS_WIDTH; k++)
+            b[k] = (uint8_t) (ctx->rk[4*r + k%16/4] >> (8 * (k%4)));
+        memcpy(&v, b, sizeof v);
+        for (i = 0; i < 8; i++)
+            rk[r][i] = (bs_word) ((v & (uint8_t) (1u << i)) != 0);
+    }
+}
+
+BS_INLINE void
+bs_add_round_key(bs_word x[8], const bs_word rk[8])
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        x[i] ^= rk[i];
+}
+
+/* The S-box circuit from J. Boyar and R. Peralta, "A depth-16
+   circuit for the AES S-box" (2011).  U0 and S0 are the most
+   significant bits.  */
+#define X(a, b) ((a) ^ (b))
+#define A(a, b) ((a) & (b))
+#define N(a, b) (~((a) ^ (b)))
+
+BS_INLINE void
+bs_sub_bytes(bs_word x[8])
+{
+    const bs_word U0 = x[7], U1 = x[6], U2 = x[5], U3 = x[4];
+    const bs_word U4 = x[3], U5 = x[2], U6 = x[1], U7 = x[0];
+
+    bs_word T1 = X(U0, U3), T2 = X(U0, U5), T3 = X(U0, U6);
+    bs_word T4 = X(U3, U5), T5 = X(U4, U6), T6 = X(T1, T5);
+    bs_word T7 = X(U1, U2), T8 = X(U7, T6), T9 = X(U7, T7);
+    bs_word T10 = X(T6, T7), T11 = X(U1, U5), T12 = X(U2, U5);
+    bs_word T13 = X(T3, T4), T14 = X(T6, T11), T15 = X(T5, T11);
+    bs_word T16 = X(T5, T12), T17 = X(T9, T16), T18 = X(U3, U7);
+    bs_word T19 = X(T7, T18), T20 = X(T1, T19), T21 = X(U6, U7);
+    bs_word T22 = X(T7, T21), T23 = X(T2, T22), T24 = X(T2, T10);
+    bs_word T25 = X(T20, T17), T26 = X(T3, T16), T27 = X(T1, T12);
+
+    bs_word M1 = A(T13, T6), M2 = A(T23, T8), M3 = X(T14, M1);
+    bs_word M4 = A(T19, U7), M5 = X(M4, M1), M6 = A(T3, T16);
+    bs_word M7 = A(T22, T9), M8 = X(T26, M6), M9 = A(T20, T17);
+    bs_word M10 = X(M9, M6), M11 = A(T1, T15), M12 = A(T4, T27);
+    bs_word M13 = X(M12, M11), M14 = A(T2, T10), M15 = X(M14, M11);
+    bs_word M16 = X(M3, M2), M17 = X(M5, T24), M18 = X(M8, M7);
+    bs_word M19 = X(M10, M15), M20 = X(M16, M13), M21 = X(M17, M15);
+    bs_word M22 = X(M18, M13), M23 = X(M19, T25), M24 = X(M22, M23);
+    bs_word M25 = A(M22, M20), M26 = X(M21, M25), M27 = X(M20, M21);
+    bs_word M28 = X(M23, M25), M29 = A(M28, M27), M30 = A(M26, M24);
+    bs_word M31 = A(M20, M23), M32 = A(M27, M31), M33 = X(M27, M25);
+    bs_word M34 = A(M21, M22), M35 = A(M24, M34), M36 = X(M24, M25);
+    bs_word M37 = X(M21, M29), M38 = X(M32, M33), M39 = X(M23, M30);
+    bs_word M40 = X(M35, M36), M41 = X(M38, M40), M42 = X(M37, M39);
+    bs_word M43 = X(M37, M38), M44 = X(M39, M40), M45 = X(M42, M41);
+    bs_word M46 = A(M44, T6), M47 = A(M40, T8), M48 = A(M39, U7);
+    bs_word M49 = A(M43, T16), M50 = A(M38, T9), M51 = A(M37, T17);
+    bs_word M52 = A(M42, T15), M53 = A(M45, T27), M54 = A(M41, T10);
+    bs_word M55 = A(M44, T13), M56 = A(M40, T23), M57 = A(M39, T19);
+    bs_word M58 = A(M43, T3), M59 = A(M38, T22), M60 = A(M37, T20);
+    bs_word M61 = A(M42, T1), M62 = A(M45, T4), M63 = A(M41, T2);
+
+    bs_word L0 = X(M61, M62), L1 = X(M50, M56), L2 = X(M46, M48);
+    bs_word L3 = X(M47, M55), L4 = X(M54, M58), L5 = X(M49, M61);
+    bs_word L6 = X(M62, L5), L7 = X(M46, L3), L8 = X(M51, M59);
+    bs_word L9 = X(M52, M53), L10 = X(M53, L4), L11 = X(M60, L2);
+    bs_word L12 = X(M48, M51), L13 = X(M50, L0), L14 = X(M52, M61);
+    bs_word L15 = X(M55, L1), L16 = X(M56, L0), L17 = X(M57, L1);
+    bs_word L18 = X(M58, L8), L19 = X(M63, L4), L20 = X(L0, L1);
+    bs_word L21 = X(L1, L7), L22 = X(L3, L12), L23 = X(L18, L2);
+    bs_word L24 = X(L15, L9), L25 = X(L6, L10), L26 = X(L7, L9);
+    bs_word L27 = X(L8, L10), L28 = X(L11, L14), L29 = X(L11, L17);
+
+    x[7] = X(L6, L24);
+    x[6] = N(L16, L26);
+    x[5] = N(L19, L28);
+    x[4] = X(L6, L21);
+    x[3] = X(L20, L22);
+    x[2] = X(L25, L29);
+    x[1] = N(L13, L27);
+    x[0] = N(L6, L23);
+}
+
+#undef X
+#undef A
+#undef N
+
+/* Row R of each column is byte R of its word; it moves left by R
+   columns, within its own lane.  */
+BS_INLINE void
+bs_shift_rows(bs_word x[8])
+{
+#if BS_WIDTH == 32
+    const bs_index rot1 = { 1, 2, 3, 0, 5, 6, 7, 4 };
+    const bs_index rot2 = { 2, 3, 0, 1, 6, 7, 4, 5 };
+    const bs_index rot3 = { 3, 0, 1, 2, 7, 4, 5, 6 };
+#else
+    const bs_index rot1 = { 1, 2, 3, 0 };
+    const bs_index rot2 = { 2, 3, 0, 1 };
+    const bs_index rot3 = { 3, 0, 1, 2 };
+#endif
+    int i;
+
+    for (i = 0; i < 8; i++)
+        x[i] = ((x[i] & 0x000000ffu)
+                | __builtin_shuffle(x[i] & 0x0000ff00u, rot1)
+                | __builtin_shuffle(x[i] & 0x00ff0000u, rot2)
+                | __builtin_shuffle(x[i] & 0xff000000u, rot3));
+}
+
+/* Each output byte is 2*a[r] + 3*a[r+1] + a[r+2] + a[r+3], which is
+   xtime(a[r] ^ a[r+1]) ^ a[r+1] ^ a[r+2] ^ a[r+3].  Rotating each
+   word right by 8 bits brings a[r+1] into row r, and xtime is a
+   renaming of planes with the reduction polynomial folded in.  */
+#define BS_ROTR(w, n) (((w) >> (n)) | ((w) << (32 - (n))))
+
+BS_INLINE void
+bs_mix_columns(bs_word x[8])
+{
+    bs_word t[8], r[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        r[i] = BS_ROTR(x[i], 8);
+        t[i] = x[i] ^ r[i];
+        r[i] ^= BS_ROTR(x[i], 16) ^ BS_ROTR(x[i], 24);
+    }
+
+    x[0] = r[0] ^ t[7];
+    x[1] = r[1] ^ t[0] ^ t[7];
+    x[2] = r[2] ^ t[1];
+    x[3] = r[3] ^ t[2] ^ t[7];
+    x[4] = r[4] ^ t[3] ^ t[7];
+    x[5] = r[5] ^ t[4];
+    x[6] = r[6] ^ t[5];
+    x[7] = r[7] ^ t[6];
+}
+
+#undef BS_ROTR
+
+/* Encipher the BS_BLOCKS consecutive 16-byte blocks at INPUT into
+   OUTPUT.  Block J of lane L goes in the low bits of plane word J,
+   lane L.  */
+BS_TARGET static void
+bs_encrypt(bs_round_keys rk, int nr,
+           const uint8_t *input, uint8_t *output)
+{
+    bs_word x[8];
+    int i, l, r;
+
+    for (i = 0; i < 8; i++)
+        for (l = 0; l < BS_WIDTH / 16; l++)
+            memcpy((uint8_t *)&x[i] + 16*l, input + 16*(8*l + i), 16);
+    bs_transpose(x);
+
+    bs_add_round_key(x, rk[0]);
+    for (r = 1; r < nr; r++)
+    {
+        bs_sub_bytes(x);
+        bs_shift_rows(x);
+        bs_mix_columns(x);
+        bs_add_round_key(x, rk[r]);
+    }
+    bs_sub_bytes(x);
+    bs_shift_rows(x);
+    bs_add_round_key(x, rk[nr]);
+
+    bs_transpose(x);
+    for (i = 0; i < 8; i++)
+        for (l = 0; l < BS_WIDTH / 16; l++)
+            memcpy(output + 16*(8*l + i), (const uint8_t *)&x[i] + 16*l, 16);
+}
+
+static void
+BS_FN(aes_encrypt_bitslice)(const aes_context *ctx,
+                            const uint8_t input[16], uint8_t output[16])
+{
+    uint8_t in[BS_BLOCKS * 16], out[BS_BLOCKS * 16];
+    bs_round_keys rk;
+
+    bs_slice_keys(ctx, rk);
+    memset(in, 0, sizeof in);
+    memcpy(in, input, 16);
+    bs_encrypt(rk, ctx->nr, in, out);
+    memcpy(output, out, 16);
+}
+
+static void
+BS_FN(aes_ctr_blocks_bitslice)(const aes_context *ctx, size_t block,
+                               size_t nblocks, uint8_t *obuf)
+{
+    uint8_t counters[BS_BLOCKS * 16], out[BS_BLOCKS * 16];
+    bs_round_keys rk;
+
+    bs_slice_keys(ctx, rk);
+    for (; nblocks >= BS_BLOCKS;
+         nblocks -= BS_BLOCKS, block += BS_BLOCKS, obuf += 16 * BS_BLOCKS)
+    {
+        bs_counters(counters, ctx->nonce, block, BS_BLOCKS);
+        bs_encrypt(rk, ctx->nr, counters, obuf);
+    }
+    if (nblocks)
+    {
+        bs_counters(counters, ctx->nonce, block, BS_BLOCKS);
+        bs_encrypt(rk, ctx->nr, counters, out);
+        memcpy(obuf, out, 16 * nblocks);
+    }
+}
+
+#undef bs_word
+#undef bs_index
+#undef bs_transpose
+#undef bs_bytes
+#undef bs_round_keys
+#undef bs_slice_keys
+#undef bs_add_round_key
+#undef bs_sub_bytes
+#undef bs_shift_rows
+#undef bs_mix_columns
+#undef bs_encrypt
+
+#undef BS_CAT_
+#undef BS_CAT
+#undef BS_FN
+#undef BS_INLINE
+#undef BS_BLOCKS
+
+#undef BS_ISA
+#undef BS_TARGET
+#undef BS_WIDTH
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
@@ -28,7 +28,9 @@
  */
 
 #include "ciphers.h"
+#include "contexts.h"
 
+#include <immintrin.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,13 +39,26 @@
 _Static_assert(sizeof(size_t) <= 16,
                "aes_gen_keystream requires size_t smaller than 16b");
 
-typedef struct
+/*
+ * There are three implementations of the block function: PolarSSL's
+ * T-tables, the AES-NI instructions, and a bitsliced version for
+ * CPUs without AES-NI.  All use the same round-key layout; the
+ * bitsliced version transforms it afresh on every call.  Each
+ * context records the one that was chosen when its key was set up;
+ * aes_default_backend picks the first one the CPU supports.
+ */
+typedef struct aes_backend
 {
-    int nr;                     /*!<  number of rounds  */
-    uint32_t *rk;               /*!<  AES round keys    */
-    uint32_t buf[68];           /*!<  unaligned data    */
+    const char *name;
+    bool (*supported)(void);
+    void (*setkey128)(aes_context *ctx, const uint8_t *key);
+    void (*setkey256)(aes_context *ctx, const uint8_t *key);
+    void (*encrypt)(const aes_context *ctx,
+                    const uint8_t input[16], uint8_t output[16]);
+    void (*ctr_blocks)(const aes_context *ctx, size_t block,
+                       size_t nblocks, uint8_t *obuf);
 }
-aes_context;
+aes_backend;
 
 /*
  * Forward S-box
@@ -202,9 +217,8 @@ static const uint32_t RCON[10] = {
  * AES key schedule (encryption)
  */
 static void
-aes128_init(void *ctx_, const uint8_t *key)
+aes128_setkey_ttable(aes_context *ctx, const uint8_t *key)
 {
-    aes_context *ctx = ctx_;
     unsigned int i;
     uint32_t *RK;
 
@@ -229,9 +243,8 @@ aes128_init(void *ctx_, const uint8_t *key)
 }
 
 static void
-aes256_init(void *ctx_, const uint8_t *key)
+aes256_setkey_ttable(aes_context *ctx, const uint8_t *key)
 {
-    aes_context *ctx = ctx_;
     unsigned int i;
     uint32_t *RK;
     ctx->nr = 14;
@@ -290,12 +303,11 @@ aes256_init(void *ctx_, const uint8_t *key)
              FT3[ ( Y2 >> 24 ) & 0xFF ];                \
     } while (0)
 
-static int
-aes_encrypt_block(void *ctx_,
-                  const uint8_t input[16],
-                  uint8_t output[16])
+static void
+aes_encrypt_ttable(const aes_context *ctx,
+                   const uint8_t input[16],
+                   uint8_t output[16])
 {
-    aes_context *ctx = ctx_;
     int i;
     uint32_t *RK, X0, X1, X2, X3, Y0, Y1, Y2, Y3;
 
@@ -346,60 +358,383 @@ aes_encrypt_block(void *ctx_,
     PUT_UINT32_LE(X1, output, 4);
     PUT_UINT32_LE(X2, output, 8);
     PUT_UINT32_LE(X3, output, 12);
-
-    return (0);
 }
 
 #undef AES_FROUND
 #undef GET_UINT32_LE
 #undef PUT_UINT32_LE
 
+/*
+ * AES-NI implementation.  Each round of each block is one
+ * instruction, but that instruction has several cycles of latency,
+ * so the counter-mode path keeps eight independent blocks in flight.
+ * The key schedule is expanded with AESKEYGENASSIST into the same
+ * layout the T-table code uses: each round key as four little-endian
+ * words, which is exactly the byte order AESENC wants.
+ */
+#define AESNI_WIDTH 8
+
+static bool
+aesni_supported(void)
+{
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+}
+
+/* Fold the previous round key K into itself the way every key
+   schedule step does, then mix in the (already broadcast) word T.  */
+__attribute__((target("aes,sse2")))
+static inline __m128i
+aesni_expand_step(__m128i k, __m128i t)
+{
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, t);
+}
+
+#define AESNI_128_ROUND(i, rcon) do {                                   \
+        k = aesni_expand_step(k, _mm_shuffle_epi32(                     \
+                _mm_aeskeygenassist_si128(k, rcon), 0xff));             \
+        _mm_storeu_si128(&rk[i], k);                                    \
+    } while (0)
+
+__attribute__((target("aes,sse2")))
+static void
+aes128_setkey_aesni(aes_context *ctx, const uint8_t *key)
+{
+    __m128i *rk = (__m128i *)ctx->buf;
+    __m128i k;
+
+    ctx->nr = 10;
+    ctx->rk = ctx->buf;
+
+    k = _mm_loadu_si128((const __m128i *)key);
+    _mm_storeu_si128(&rk[0], k);
+    AESNI_128_ROUND( 1, 0x01);
+    AESNI_128_ROUND( 2, 0x02);
+    AESNI_128_ROUND( 3, 0x04);
+    AESNI_128_ROUND( 4, 0x08);
+    AESNI_128_ROUND( 5, 0x10);
+    AESNI_128_ROUND( 6, 0x20);
+    AESNI_128_ROUND( 7, 0x40);
+    AESNI_128_ROUND( 8, 0x80);
+    AESNI_128_ROUND( 9, 0x1b);
+    AESNI_128_ROUND(10, 0x36);
+}
+
+#undef AESNI_128_ROUND
+
+/* AES-256 alternates two kinds of step: the even round keys take
+   RotWord+SubWord+Rcon of the last word of the odd key before them,
+   the odd ones take just SubWord of the last word of the even key.  */
+#define AESNI_256_ROUND(i, rcon) do {                                   \
+        k0 = aesni_expand_step(k0, _mm_shuffle_epi32(                   \
+                _mm_aeskeygenassist_si128(k1, rcon), 0xff));            \
+        _mm_storeu_si128(&rk[i], k0);                                   \
+        if (i < 14)                                                     \
+        {                                                               \
+            k1 = aesni_expand_step(k1, _mm_shuffle_epi32(               \
+                    _mm_aeskeygenassist_si128(k0, 0), 0xaa));           \
+            _mm_storeu_si128(&rk[i+1], k1);                             \
+        }                                                               \
+    } while (0)
+
+__attribute__((target("aes,sse2")))
+static void
+aes256_setkey_aesni(aes_context *ctx, const uint8_t *key)
+{
+    __m128i *rk = (__m128i *)ctx->buf;
+    __m128i k0, k1;
+
+    ctx->nr = 14;
+    ctx->rk = ctx->buf;
+
+    k0 = _mm_loadu_si128((const __m128i *)key);
+    k1 = _mm_loadu_si128((const __m128i *)(key + 16));
+    _mm_storeu_si128(&rk[0], k0);
+    _mm_storeu_si128(&rk[1], k1);
+    AESNI_256_ROUND( 2, 0x01);
+    AESNI_256_ROUND( 4, 0x02);
+    AESNI_256_ROUND( 6, 0x04);
+    AESNI_256_ROUND( 8, 0x08);
+    AESNI_256_ROUND(10, 0x10);
+    AESNI_256_ROUND(12, 0x20);
+    AESNI_256_ROUND(14, 0x40);
+}
+
+#undef AESNI_256_ROUND
+
+__attribute__((target("aes,sse2")))
+static inline __m128i
+aesni_encrypt(const __m128i *rk, int nr, __m128i x)
+{
+    int r;
+    x = _mm_xor_si128(x, _mm_loadu_si128(&rk[0]));
+    for (r = 1; r < nr; r++)
+        x = _mm_aesenc_si128(x, _mm_loadu_si128(&rk[r]));
+    return _mm_aesenclast_si128(x, _mm_loadu_si128(&rk[nr]));
+}
+
+__attribute__((target("aes,sse2")))
+static void
+aes_encrypt_aesni(const aes_context *ctx,
+                  const uint8_t input[16],
+                  uint8_t output[16])
+{
+    _mm_storeu_si128((__m128i *)output,
+                     aesni_encrypt((const __m128i *)ctx->rk, ctx->nr,
+                                   _mm_loadu_si128((const __m128i *)input)));
+}
+
 /*
  * Counter-mode stream cipher construction.
  * This may not be precisely the same as NIST AES-CTR,
  * but for this application it doesn't matter.
+ *
+ * The counter is a 128-bit big-endian number whose upper half is the
+ * nonce and whose lower half is the block number.  The backends'
+ * ctr_blocks functions write the encipherment of counter values
+ * BLOCK through BLOCK+NBLOCKS-1 straight to OBUF; aes_gen_keystream
+ * only has to deal with partial blocks at either end.
  */
 static void
-aes_gen_keystream(void *ctx_, size_t offset,
-                  uint8_t *obuf, size_t olen)
+aes_ctr_blocks_ttable(const aes_context *ctx, size_t block, size_t nblocks,
+                      uint8_t *obuf)
 {
     uint8_t counter[16];
-    uint8_t block[16];
-    uint8_t *limit = obuf + olen;
-    size_t offset_128b, offset_rem, i;
-
-    if (olen == 0)
-        return;
+    size_t i;
 
     memset(counter, 0, 16);
-    offset_128b = offset / 16;
-    offset_rem  = offset % 16;
+    for (i = 0; i < 8; i++)
+        counter[7 - i] = (ctx->nonce >> (8 * i)) & 0xFF;
     for (i = 0; i < sizeof(size_t); i++)
     {
-        if (offset_128b == 0)
-            break;
-        counter[15 - i] = offset_128b & 0xFF;
-        offset_128b >>= 8;
+        counter[15 - i] = block & 0xFF;
+        block >>= 8;
     }
 
-    i = offset_rem;
-    for (;;)
+    for (; nblocks > 0; nblocks--, obuf += 16)
     {
-        aes_encrypt_block(ctx_, counter, block);
-        for (; i < 16; i++)
-        {
-            *obuf++ = block[i];
-            if (obuf >= limit)
-                return;
-        }
+        aes_encrypt_ttable(ctx, counter, obuf);
 
         /* increment counter */
         for (i = 0; i < 16; i++)
             if (++counter[15 - i] != 0)
                 break;
+    }
+}
+
+/* A size_t block number never carries into the nonce.  */
+__attribute__((target("aes,sse2")))
+static inline __m128i
+aesni_counter(uint64_t nonce, size_t block)
+{
+    return _mm_set_epi64x((long long)__builtin_bswap64(block),
+                          (long long)__builtin_bswap64(nonce));
+}
+
+__attribute__((target("aes,sse2")))
+static void
+aes_ctr_blocks_aesni(const aes_context *ctx, size_t block, size_t nblocks,
+                     uint8_t *obuf)
+{
+    const __m128i *rk = (const __m128i *)ctx->rk;
+    uint64_t nonce = ctx->nonce;
+    __m128i x[AESNI_WIDTH], k;
+    int r, nr = ctx->nr;
+    unsigned int j;
+
+    for (; nblocks >= AESNI_WIDTH;
+         nblocks -= AESNI_WIDTH, block += AESNI_WIDTH,
+             obuf += 16 * AESNI_WIDTH)
+    {
+        k = _mm_loadu_si128(&rk[0]);
+        for (j = 0; j < AESNI_WIDTH; j++)
+            x[j] = _mm_xor_si128(aesni_counter(nonce, block + j), k);
+        for (r = 1; r < nr; r++)
+        {
+            k = _mm_loadu_si128(&rk[r]);
+            for (j = 0; j < AESNI_WIDTH; j++)
+                x[j] = _mm_aesenc_si128(x[j], k);
+        }
+        k = _mm_loadu_si128(&rk[nr]);
+        for (j = 0; j < AESNI_WIDTH; j++)
+            _mm_storeu_si128((__m128i *)(obuf + 16*j),
+                             _mm_aesenclast_si128(x[j], k));
+    }
+
+    for (; nblocks > 0; nblocks--, block++, obuf += 16)
+        _mm_storeu_si128((__m128i *)obuf,
+                         aesni_encrypt(rk, nr, aesni_counter(nonce, block)));
+}
+
+/*
+ * Bitsliced implementation, after Kasper and Schwabe, for CPUs
+ * without AES-NI, where the T-tables are cache-bound.  The kernel
+ * itself is in aes-bitslice.h, instantiated once per vector width;
+ * here are the parts they share.  Key setup is the T-table one; the
+ * kernels slice the round keys themselves.
+ */
+
+/* Write N consecutive counter blocks, starting at BLOCK, with nonce
+   NONCE, to COUNTERS.  */
+static void
+bs_counters(uint8_t *counters, uint64_t nonce, size_t block, size_t n)
+{
+    size_t i, j, c;
+
+    memset(counters, 0, n * 16);
+    for (j = 0; j < n; j++)
+    {
+        for (i = 0; i < 8; i++)
+            counters[16*j + 7 - i] = (nonce >> (8 * i)) & 0xFF;
+        for (i = 0, c = block + j; i < sizeof(size_t); i++, c >>= 8)
+            counters[16*j + 15 - i] = c & 0xFF;
+    }
+}
+
+/* AVX2: sixteen blocks, one 256-bit register per plane.  */
+#define BS_ISA    avx2
+#define BS_TARGET __attribute__((target("avx2")))
+#define BS_WIDTH  32
+#include "aes-bitslice.h"
+
+/* SSE2: eight blocks, one 128-bit register per plane.  Sixteen blocks
+   would need all sixteen XMM registers just to hold the state.  */
+#define BS_ISA    sse2
+#define BS_TARGET
+#define BS_WIDTH  16
+#include "aes-bitslice.h"
+
+static bool
+avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool
+always_supported(void)
+{
+    return true;
+}
+
+/* Fastest first, at the size of the worker's calls, as measured by
+   cipher-test's IMPL pass.  The SSE2 bitsliced kernel comes out
+   slower than the T-tables there, so it is only used on request.  */
+static const aes_backend aes_backends[] = {
+    { "aesni", aesni_supported,
+      aes128_setkey_aesni, aes256_setkey_aesni,
+      aes_encrypt_aesni, aes_ctr_blocks_aesni },
+    { "bitslice-avx2", avx2_supported,
+      aes128_setkey_ttable, aes256_setkey_ttable,
+      aes_encrypt_bitslice_avx2, aes_ctr_blocks_bitslice_avx2 },
+    { "ttable", always_supported,
+      aes128_setkey_ttable, aes256_setkey_ttable,
+      aes_encrypt_ttable, aes_ctr_blocks_ttable },
+    { "bitslice-sse2", always_supported,
+      aes128_setkey_ttable, aes256_setkey_ttable,
+      aes_encrypt_bitslice_sse2, aes_ctr_blocks_bitslice_sse2 },
+    { 0, 0, 0, 0, 0, 0 }
+};
+
+static const char *const aes_impls[] = {
+    "aesni", "bitslice-avx2", "ttable", "bitslice-sse2", 0
+};
+
+/* Set by aes_use_impl; shared by aes128 and aes256.  */
+static const aes_backend *aes_forced_backend;
+
+static const aes_backend *
+aes_best_backend(void)
+{
+    const aes_backend *b;
+    for (b = aes_backends; !b->supported(); b++)
+        ;
+    return b;
+}
+
+static const aes_backend *
+aes_default_backend(void)
+{
+    if (aes_forced_backend)
+        return aes_forced_backend;
+    return aes_best_backend();
+}
+
+static bool
+aes_use_impl(const char *name)
+{
+    const aes_backend *b;
 
-        i = 0;
+    if (!name)
+    {
+        aes_forced_backend = 0;
+        return true;
     }
+    for (b = aes_backends; b->name; b++)
+        if (!strcmp(b->name, name))
+        {
+            if (!b->supported())
+                return false;
+            aes_forced_backend = b;
+            return true;
+        }
+    return false;
+}
+
+static const char *
+aes_current_impl(void)
+{
+    return aes_default_backend()->name;
+}
+
+static void
+aes128_init(void *ctx_, const uint8_t *key)
+{
+    aes_context *ctx = ctx_;
+    ctx->impl = aes_default_backend();
+    ctx->impl->setkey128(ctx, key);
+    ctx->nonce = 0;
+}
+
+void
+aes128_keygen_init(void *ctx_, const uint8_t *key)
+{
+    aes_context *ctx = ctx_;
+    ctx->impl = aes_best_backend();
+    ctx->impl->setkey128(ctx, key);
+    ctx->nonce = 0;
+}
+
+static void
+aes256_init(void *ctx_, const uint8_t *key)
+{
+    aes_context *ctx = ctx_;
+    ctx->impl = aes_default_backend();
+    ctx->impl->setkey256(ctx, key);
+    ctx->nonce = 0;
+}
+
+/* NONCE becomes the upper half of the counter.  */
+static void
+aes_set_nonce(void *ctx_, uint64_t nonce)
+{
+    aes_context *ctx = ctx_;
+    ctx->nonce = nonce;
+}
+
+static void
+aes_gen_blocks(void *ctx_, uint64_t block, size_t nblocks,
+               uint8_t *obuf)
+{
+    const aes_context *ctx = ctx_;
+    ctx->impl->ctr_blocks(ctx, block, nblocks, obuf);
+}
+
+static void
+aes_gen_keystream(void *ctx, size_t offset, uint8_t *obuf, size_t olen)
+{
+    cipher_ctr_gen_keystream(aes_gen_blocks, 16, ctx, offset, obuf, olen);
 }
 
 /*
@@ -1081,7 +1416,7 @@ dump_hex(const char *label, const uint8_t *p, size_t n)
 }
 
 static void
-aes_selftest_vk(void (*init)(void *, const uint8_t *),
+aes_selftest_vk(const aes_backend *b,
                 uint8_t expected[][16],
                 size_t n)
 {
@@ -1097,11 +1432,14 @@ aes_selftest_vk(void (*init)(void *, const uint8_t *),
     {
         memset(key, 0, 32);
         key[i/8] |= (1 << (7 - i%8));
-        init(&ctx, key);
-        aes_encrypt_block(&ctx, pt, ct);
+        if (n == 128)
+            b->setkey128(&ctx, key);
+        else
+            b->setkey256(&ctx, key);
+        b->encrypt(&ctx, pt, ct);
         if (memcmp(ct, expected[i], 16))
         {
-            fprintf(stderr, "FAIL: aes_vk_%zd[%zd]:\n", n, i);
+            fprintf(stderr, "FAIL: %s aes_vk_%zd[%zd]:\n", b->name, n, i);
             dump_hex("key: ", key, n/8);
             dump_hex("exp: ", expected[i], 16);
             dump_hex("got: ", ct, 16);
@@ -1114,7 +1452,7 @@ aes_selftest_vk(void (*init)(void *, const uint8_t *),
 }
 
 static void
-aes_selftest_vt(void (*init)(void *, const uint8_t *),
+aes_selftest_vt(const aes_backend *b,
                 uint8_t expected[][16],
                 size_t n)
 {
@@ -1127,16 +1465,19 @@ aes_selftest_vt(void (*init)(void *, const uint8_t *),
 
     /* always provide the maximum size key */
     memset(key, 0, 32);
-    init(&ctx, key);
+    if (n == 128)
+        b->setkey128(&ctx, key);
+    else
+        b->setkey256(&ctx, key);
 
     for (i = 0; i < 128; i++)
     {
         memset(pt, 0, 16);
         pt[i/8] |= (1 << (7 - i%8));
-        aes_encrypt_block(&ctx, pt, ct);
+        b->encrypt(&ctx, pt, ct);
         if (memcmp(ct, expected[i], 16))
         {
-            fprintf(stderr, "FAIL: aes_vt_%zd[%zd]:\n", n, i);
+            fprintf(stderr, "FAIL: %s aes_vt_%zd[%zd]:\n", b->name, n, i);
             dump_hex("exp: ", expected[i], 16);
             dump_hex("got: ", ct, 16);
             failed = true;
@@ -1248,7 +1589,7 @@ aes_test_keystreams[2][18] = {
 };
 
 static void
-aes_selftest_ks(void)
+aes_selftest_ks(const aes_backend *b)
 {
     int i, j;
     uint8_t ksbuf[16];
@@ -1257,7 +1598,9 @@ aes_selftest_ks(void)
 
     for (i = 0; i < 2; i++)
     {
-        aes128_init(&ctx, aes_test_keystream_keys[i]);
+        ctx.impl = b;
+        ctx.nonce = 0;
+        b->setkey128(&ctx, aes_test_keystream_keys[i]);
 
         for (j = 0; j < 18; j++)
         {
@@ -1267,8 +1610,9 @@ aes_selftest_ks(void)
 
             if (memcmp(ksbuf, aes_test_keystreams[i][j].sample, 16))
             {
-                fprintf(stderr, "FAIL: aes128 keystream %d/%d (offset %d):\n",
-                        i+1, j+1, aes_test_keystreams[i][j].offset);
+                fprintf(stderr,
+                        "FAIL: %s aes128 keystream %d/%d (offset %d):\n",
+                        b->name, i+1, j+1, aes_test_keystreams[i][j].offset);
                 dump_hex("  exp: ", aes_test_keystreams[i][j].sample, 16);
                 dump_hex("  got: ", ksbuf, 16);
                 putc('\n', stderr);
@@ -1280,20 +1624,81 @@ aes_selftest_ks(void)
         abort();
 }
 
+/* NIST SP 800-38A, F.5.1: CTR-AES128.  Its initial counter block is
+   F0F1...FEFF, which is our nonce F0F1F2F3F4F5F6F7 with block number
+   F8F9FAFBFCFDFEFF; the test runs four blocks from there.  */
+static const uint8_t
+aes_test_nonce_key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+    0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+static const uint8_t
+aes_test_nonce_keystream[64] = {
+    0xec, 0x8c, 0xdf, 0x73, 0x98, 0x60, 0x7c, 0xb0,
+    0xf2, 0xd2, 0x16, 0x75, 0xea, 0x9e, 0xa1, 0xe4,
+    0x36, 0x2b, 0x7c, 0x3c, 0x67, 0x73, 0x51, 0x63,
+    0x18, 0xa0, 0x77, 0xd7, 0xfc, 0x50, 0x73, 0xae,
+    0x6a, 0x2c, 0xc3, 0x78, 0x78, 0x89, 0x37, 0x4f,
+    0xbe, 0xb4, 0xc8, 0x1b, 0x17, 0xba, 0x6c, 0x44,
+    0xe8, 0x9c, 0x39, 0x9f, 0xf0, 0xf1, 0x98, 0xc6,
+    0xd4, 0x0a, 0x31, 0xdb, 0x15, 0x6c, 0xab, 0xfe
+};
+
+static void
+aes_selftest_nonce(const aes_backend *b)
+{
+    uint8_t ksbuf[64];
+    aes_context ctx;
+
+    ctx.impl = b;
+    b->setkey128(&ctx, aes_test_nonce_key);
+    aes_set_nonce(&ctx, 0xf0f1f2f3f4f5f6f7ull);
+    aes_gen_blocks(&ctx, 0xf8f9fafbfcfdfeffull, 4, ksbuf);
+
+    if (memcmp(ksbuf, aes_test_nonce_keystream, 64))
+    {
+        fprintf(stderr, "FAIL: %s aes128 keystream with nonce:\n",
+                b->name);
+        dump_hex("  exp: ", aes_test_nonce_keystream, 64);
+        dump_hex("  got: ", ksbuf, 64);
+        putc('\n', stderr);
+        abort();
+    }
+}
+
+/* Test every backend this CPU can run, not just the default.  */
 static void
 aes_selftest(void)
 {
-    aes_selftest_vk(aes128_init, aes_vk_128, 128);
-    aes_selftest_vk(aes256_init, aes_vk_256, 256);
+    const aes_backend *b;
 
-    aes_selftest_vt(aes128_init, aes_vt_128, 128);
-    aes_selftest_vt(aes256_init, aes_vt_256, 256);
+    for (b = aes_backends; b->name; b++)
+    {
+        if (!b->supported())
+            continue;
+
+        aes_selftest_vk(b, aes_vk_128, 128);
+        aes_selftest_vk(b, aes_vk_256, 256);
 
-    aes_selftest_ks();
+        aes_selftest_vt(b, aes_vt_128, 128);
+        aes_selftest_vt(b, aes_vt_256, 256);
+
+        aes_selftest_ks(b);
+        aes_selftest_nonce(b);
+    }
 }
 
-DEFINE_CIPHER(aes128, aes, 16);
-DEFINE_CIPHER(aes256, aes, 32);
+DEFINE_CIPHER(aes128, aes, 16,
+              .impls = aes_impls, .use_impl = aes_use_impl,
+              .current_impl = aes_current_impl,
+              .blocksize = 16, .gen_blocks = aes_gen_blocks,
+              .set_nonce = aes_set_nonce);
+DEFINE_CIPHER(aes256, aes, 32,
+              .impls = aes_impls, .use_impl = aes_use_impl,
+              .current_impl = aes_current_impl,
+              .blocksize = 16, .gen_blocks = aes_gen_blocks,
+              .set_nonce = aes_set_nonce);
 
 /*
  * Local Variables:
@@ -27,21 +27,13 @@
  */
 
 #include "ciphers.h"
+#include "contexts.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-typedef struct
-{
-    size_t offset;
-    int x;
-    int y;
-    uint8_t m[256];
-}
-arc4_context;
-
 static void
 arc4_init(void *ctx_, const uint8_t *key)
 {
@@ -74,6 +66,12 @@ arc4_init(void *ctx_, const uint8_t *key)
 
 #define ARC4_ROUND(x, y, a, b, m) do {          \
         x = (x + 1) & 0xFF;                     \
+        ARC4_STEP(x, y, a, b, m);               \
+    } while (0);
+
+/* The part of a round that depends on the state; X has already been
+   advanced.  */
+#define ARC4_STEP(x, y, a, b, m) do {           \
         a = m[x];                               \
         y = (y + a) & 0xFF;                     \
         b = m[y];                               \
@@ -111,6 +109,155 @@ arc4_gen_keystream(void *ctx_, size_t offset, uint8_t *obuf, size_t olen)
     ctx->offset = offset + olen;
 }
 
+/* The batch entry points run up to ARC4_LANES contexts in lock-step,
+   one round of each in turn.  A single context's rounds form one long
+   chain of dependent loads and stores through its S-box; interleaving
+   independent contexts gives the CPU something to do while each load
+   is in flight.  Four lanes already come close to the limit set by
+   the two stores per byte, and more lanes run out of registers.  The
+   batch layout is simply an array of contexts.  All contexts in a
+   batch are always at the same offset, so they can share one X.  */
+#define ARC4_LANES 4
+
+/* Run key setup for NL contexts from iteration START onward, where
+   every lane's state after the first START iterations is M0 and J0.  */
+static inline __attribute__((always_inline)) void
+arc4_init_lanes(arc4_context *ctx, const uint8_t *keys, size_t nl,
+                const uint8_t m0[256], int j0, int start)
+{
+    int i, a, j[ARC4_LANES];
+    size_t l;
+    uint8_t *m;
+
+    for (l = 0; l < nl; l++)
+    {
+        ctx[l].offset = 0;
+        ctx[l].x = 0;
+        ctx[l].y = 0;
+        memcpy(ctx[l].m, m0, 256);
+        j[l] = j0;
+    }
+
+    for (i = start; i < 256; i++)
+        for (l = 0; l < nl; l++)
+        {
+            m = ctx[l].m;
+            a = m[i];
+            j[l] = (j[l] + a + keys[16*l + (i & 15)]) & 0xFF;
+            m[i] = m[j[l]];
+            m[j[l]] = (uint8_t)a;
+        }
+}
+
+static void
+arc4_init_batch_from(arc4_context *ctx, const uint8_t *keys, size_t n,
+                     const uint8_t m0[256], int j0, int start)
+{
+    size_t k;
+
+    for (k = 0; k + ARC4_LANES <= n; k += ARC4_LANES)
+        arc4_init_lanes(ctx + k, keys + 16*k, ARC4_LANES, m0, j0, start);
+    if (k < n)
+        arc4_init_lanes(ctx + k, keys + 16*k, n - k, m0, j0, start);
+}
+
+static void
+arc4_init_batch(void *ctxs, const uint8_t *keys, size_t n)
+{
+    uint8_t m0[256];
+    int i;
+
+    for (i = 0; i < 256; i++)
+        m0[i] = (uint8_t)i;
+    arc4_init_batch_from(ctxs, keys, n, m0, 0, 0);
+}
+
+/* Key byte I only enters the key setup at iterations I, I+16, I+32,
+   and so on, and every iteration depends on the J left by the one
+   before, so keys that share a prefix share only the first PREFIX
+   iterations: a 15-byte prefix saves 15 of the 256.  */
+static void
+arc4_init_batch_prefix(void *ctxs, const uint8_t *keys, size_t n,
+                       size_t prefix)
+{
+    uint8_t m0[256];
+    int i, j, a;
+
+    if (prefix > 16)
+        prefix = 16;
+
+    for (i = 0; i < 256; i++)
+        m0[i] = (uint8_t)i;
+    for (i = 0, j = 0; i < (int)prefix; i++)
+    {
+        a = m0[i];
+        j = (j + a + keys[i]) & 0xFF;
+        m0[i] = m0[j];
+        m0[j] = (uint8_t)a;
+    }
+    arc4_init_batch_from(ctxs, keys, n, m0, j, (int)prefix);
+}
+
+static inline __attribute__((always_inline)) void
+arc4_gen_keystream_lanes(arc4_context *ctx, size_t nl, size_t stride,
+                         size_t offset, uint8_t *obuf, size_t olen)
+{
+    int x, y[ARC4_LANES], a, b;
+    size_t i, l;
+    uint8_t *m, out[ARC4_LANES];
+
+    if (offset < ctx[0].offset)
+        abort();
+
+    x = ctx[0].x;
+    for (l = 0; l < nl; l++)
+        y[l] = ctx[l].y;
+
+    for (i = ctx[0].offset; i < offset; i++)
+    {
+        x = (x + 1) & 0xFF;
+        for (l = 0; l < nl; l++)
+        {
+            m = ctx[l].m;
+            ARC4_STEP(x, y[l], a, b, m);
+        }
+    }
+
+    for (i = 0; i < olen; i++)
+    {
+        x = (x + 1) & 0xFF;
+        for (l = 0; l < nl; l++)
+        {
+            m = ctx[l].m;
+            ARC4_STEP(x, y[l], a, b, m);
+            out[l] = (uint8_t) m[(uint8_t)(a + b)];
+        }
+        memcpy(obuf + i*stride, out, nl);
+    }
+
+    for (l = 0; l < nl; l++)
+    {
+        ctx[l].x = x;
+        ctx[l].y = y[l];
+        ctx[l].offset = offset + olen;
+    }
+}
+
+static void
+arc4_gen_keystream_batch(void *ctxs, size_t n, size_t offset,
+                         uint8_t *obuf, size_t olen)
+{
+    arc4_context *ctx = ctxs;
+    size_t k;
+
+    for (k = 0; k + ARC4_LANES <= n; k += ARC4_LANES)
+        arc4_gen_keystream_lanes(ctx + k, ARC4_LANES, n,
+                                 offset, obuf + k, olen);
+    if (k < n)
+        arc4_gen_keystream_lanes(ctx + k, n - k, n,
+                                 offset, obuf + k, olen);
+}
+
 /* Test vectors for 128-bit key from RFC 6229. */
 static const uint8_t
 arc4_test_keys[2][16] = {
@@ -214,6 +361,83 @@ dump_hex(const char *label, const uint8_t *p, size_t n)
     putc('\n', stderr);
 }
 
+/* Run the same vectors through the batch entry points, with the two
+   keys alternating across enough contexts to fill two groups of lanes
+   and leave a partial one.  */
+#define ARC4_TEST_BATCH (2*ARC4_LANES + 3)
+
+static void
+arc4_selftest_batch(void)
+{
+    int i, j, k;
+    uint8_t keys[ARC4_TEST_BATCH][16];
+    uint8_t ksbuf[16 * ARC4_TEST_BATCH], got[16];
+    arc4_context ctxs[ARC4_TEST_BATCH];
+    bool failed = false;
+
+    for (k = 0; k < ARC4_TEST_BATCH; k++)
+        memcpy(keys[k], arc4_test_keys[k % 2], 16);
+    arc4_init_batch(ctxs, &keys[0][0], ARC4_TEST_BATCH);
+
+    for (j = 0; j < 18; j++)
+    {
+        arc4_gen_keystream_batch(ctxs, ARC4_TEST_BATCH,
+                                 arc4_test_keystreams[0][j].offset,
+                                 ksbuf, 16);
+        for (k = 0; k < ARC4_TEST_BATCH; k++)
+        {
+            for (i = 0; i < 16; i++)
+                got[i] = ksbuf[i*ARC4_TEST_BATCH + k];
+
+            if (memcmp(got, arc4_test_keystreams[k % 2][j].sample, 16))
+            {
+                fprintf(stderr,
+                        "FAIL: arc4 batch keystream %d/%d, context %d "
+                        "(offset %d):\n",
+                        k%2 + 1, j+1, k,
+                        arc4_test_keystreams[k % 2][j].offset);
+                dump_hex("  exp: ", arc4_test_keystreams[k % 2][j].sample, 16);
+                dump_hex("  got: ", got, 16);
+                putc('\n', stderr);
+                failed = true;
+            }
+        }
+    }
+    if (failed)
+        abort();
+}
+
+/* Keys that differ only in their last byte, set up together from a
+   shared prefix, must come out the same as set up one at a time.  */
+static void
+arc4_selftest_prefix(void)
+{
+    int k;
+    uint8_t keys[ARC4_TEST_BATCH][16];
+    arc4_context ctxs[ARC4_TEST_BATCH], ctx;
+    bool failed = false;
+
+    for (k = 0; k < ARC4_TEST_BATCH; k++)
+    {
+        memcpy(keys[k], arc4_test_keys[1], 16);
+        keys[k][15] = (uint8_t)(k * 37);
+    }
+    arc4_init_batch_prefix(ctxs, &keys[0][0], ARC4_TEST_BATCH, 15);
+
+    for (k = 0; k < ARC4_TEST_BATCH; k++)
+    {
+        arc4_init(&ctx, keys[k]);
+        if (memcmp(ctx.m, ctxs[k].m, 256))
+        {
+            fprintf(stderr, "FAIL: arc4 shared-prefix key setup, "
+                    "context %d\n", k);
+            failed = true;
+        }
+    }
+    if (failed)
+        abort();
+}
+
 static void
 arc4_selftest(void)
 {
@@ -245,9 +469,15 @@ arc4_selftest(void)
     }
     if (failed)
         abort();
+
+    arc4_selftest_batch();
+    arc4_selftest_prefix();
 }
 
-DEFINE_CIPHER(arc4, arc4, 16);
+DEFINE_CIPHER(arc4, arc4, 16,
+              .init_batch = arc4_init_batch,
+              .init_batch_prefix = arc4_init_batch_prefix,
+              .gen_keystream_batch = arc4_gen_keystream_batch);
 
 /*
  * Local Variables:
@@ -0,0 +1,236 @@
+/*
+ *  Multi-block ChaCha20 kernel, instantiated by chacha20.c once per
+ *  vector width.
+ *
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The includer defines CC_ISA (a suffix for the generated names),
+ * CC_TARGET (function attributes enabling the instruction set), and
+ * CC_BLOCKS (blocks per call: 4, 8 or 16, one per 32-bit vector
+ * lane).  This file defines chacha20_ctr_blocks_<CC_ISA> and
+ * chacha20_gen_lanes_<CC_ISA>, with the signatures of
+ * chacha20_backend's ctr_blocks and gen_lanes, and undefines the
+ * three parameters again.
+ *
+ * The layout is the same as in salsa20-simd.h: one state word per
+ * register, and one block per lane in ctr_blocks or one key per lane
+ * in gen_lanes.  Words 12 and 13 are the block counter.
+ */
+
+#define CC_CAT_(a, b) a##_##b
+#define CC_CAT(a, b)  CC_CAT_(a, b)
+#define CC_FN(name)   CC_CAT(name, CC_ISA)
+
+#define cc_word  CC_FN(cc_word)
+#define cc_bytes CC_FN(cc_bytes)
+
+typedef uint32_t cc_word __attribute__((vector_size(4 * CC_BLOCKS)));
+typedef uint8_t cc_bytes __attribute__((vector_size(4 * CC_BLOCKS)));
+
+/* Shuffle masks are built one 128-bit lane at a time.  */
+#if CC_BLOCKS == 4
+#define CC_EACH_LANE(f) f(0)
+#elif CC_BLOCKS == 8
+#define CC_EACH_LANE(f) f(0), f(1)
+#define CC_ROWS         0, 4, 1, 5, 2, 6, 3, 7
+#elif CC_BLOCKS == 16
+#define CC_EACH_LANE(f) f(0), f(1), f(2), f(3)
+#define CC_ROWS         0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15
+#else
+#error "CC_BLOCKS must be 4, 8 or 16"
+#endif
+
+#define CC_LO32(q) 4*q,   CC_BLOCKS+4*q,   4*q+1, CC_BLOCKS+4*q+1
+#define CC_HI32(q) 4*q+2, CC_BLOCKS+4*q+2, 4*q+3, CC_BLOCKS+4*q+3
+#define CC_LO64(q) 4*q,   4*q+1,   CC_BLOCKS+4*q,   CC_BLOCKS+4*q+1
+#define CC_HI64(q) 4*q+2, 4*q+3,   CC_BLOCKS+4*q+2, CC_BLOCKS+4*q+3
+#define CC_BYTES(q) 16*q,   16*q+4, 16*q+8,  16*q+12, \
+                    16*q+1, 16*q+5, 16*q+9,  16*q+13, \
+                    16*q+2, 16*q+6, 16*q+10, 16*q+14, \
+                    16*q+3, 16*q+7, 16*q+11, 16*q+15
+
+#define CC_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CC_QR(a, b, c, d) do {                  \
+        a += b; d = CC_ROTL(d ^ a, 16);         \
+        c += d; b = CC_ROTL(b ^ c, 12);         \
+        a += b; d = CC_ROTL(d ^ a,  8);         \
+        c += d; b = CC_ROTL(b ^ c,  7);         \
+    } while (0)
+#define CC_ROUNDS(x, i) do {                            \
+        for (i = 20; i > 0; i -= 2)                     \
+        {                                               \
+            CC_QR(x[ 0], x[ 4], x[ 8], x[12]);          \
+            CC_QR(x[ 1], x[ 5], x[ 9], x[13]);          \
+            CC_QR(x[ 2], x[ 6], x[10], x[14]);          \
+            CC_QR(x[ 3], x[ 7], x[11], x[15]);          \
+            CC_QR(x[ 0], x[ 5], x[10], x[15]);          \
+            CC_QR(x[ 1], x[ 6], x[11], x[12]);          \
+            CC_QR(x[ 2], x[ 7], x[ 8], x[13]);          \
+            CC_QR(x[ 3], x[ 4], x[ 9], x[14]);          \
+        }                                               \
+    } while (0)
+
+/* Write CC_BLOCKS consecutive keystream blocks, starting at BLOCK, to
+   OBUF.  */
+CC_TARGET static void
+CC_FN(chacha20_blocks)(const uint32_t input[16], uint64_t block,
+                      uint8_t *obuf)
+{
+    static const cc_word lo32 = { CC_EACH_LANE(CC_LO32) };
+    static const cc_word hi32 = { CC_EACH_LANE(CC_HI32) };
+    static const cc_word lo64 = { CC_EACH_LANE(CC_LO64) };
+    static const cc_word hi64 = { CC_EACH_LANE(CC_HI64) };
+    const cc_word zero = { 0 };
+    cc_word s[16], x[16], lane;
+    int i, g, q;
+
+    for (i = 0; i < CC_BLOCKS; i++)
+        lane[i] = (uint32_t) i;
+    for (i = 0; i < 16; i++)
+        s[i] = zero + input[i];
+    s[12] = zero + (uint32_t) block;
+    s[13] = zero + (uint32_t) (block >> 32);
+    s[12] += lane;
+    s[13] -= (cc_word) (s[12] < lane);  /* carry */
+
+    for (i = 0; i < 16; i++)
+        x[i] = s[i];
+    CC_ROUNDS(x, i);
+    for (i = 0; i < 16; i++)
+        x[i] += s[i];
+
+    /* Words 4G..4G+3 of block 4Q+R end up in lane Q of T[R].  */
+    for (g = 0; g < 4; g++)
+    {
+        cc_word a = __builtin_shuffle(x[4*g+0], x[4*g+1], lo32);
+        cc_word b = __builtin_shuffle(x[4*g+0], x[4*g+1], hi32);
+        cc_word c = __builtin_shuffle(x[4*g+2], x[4*g+3], lo32);
+        cc_word d = __builtin_shuffle(x[4*g+2], x[4*g+3], hi32);
+        cc_word t[4] = {
+            __builtin_shuffle(a, c, lo64),
+            __builtin_shuffle(a, c, hi64),
+            __builtin_shuffle(b, d, lo64),
+            __builtin_shuffle(b, d, hi64),
+        };
+
+        for (q = 0; q < CC_BLOCKS / 4; q++)
+            for (i = 0; i < 4; i++)
+                memcpy(obuf + 64*(4*q + i) + 16*g,
+                       (const uint8_t *)&t[i] + 16*q, 16);
+    }
+}
+
+static void
+CC_FN(chacha20_ctr_blocks)(const chacha20_context *ctx, uint64_t block,
+                          size_t nblocks, uint8_t *obuf)
+{
+    for (; nblocks >= CC_BLOCKS;
+         nblocks -= CC_BLOCKS, block += CC_BLOCKS, obuf += 64 * CC_BLOCKS)
+        CC_FN(chacha20_blocks)(ctx->input, block, obuf);
+    chacha20_ctr_blocks_scalar(ctx, block, nblocks, obuf);
+}
+
+/* Regroup the bytes of V so that byte C of every lane, in lane order,
+   is row C: bytes C*CC_BLOCKS through C*CC_BLOCKS+CC_BLOCKS-1.  This
+   is the same transpose as ss_rows in salsa20-simd.h.  */
+CC_TARGET static inline cc_bytes
+CC_FN(cc_rows)(cc_word v)
+{
+#if CC_BLOCKS == 4
+    __m128i t = (__m128i) v;
+    t = _mm_unpacklo_epi8(t, _mm_srli_si128(t, 8));
+    t = _mm_unpacklo_epi8(t, _mm_srli_si128(t, 8));
+    return (cc_bytes) t;
+#else
+    static const cc_bytes bytes = { CC_EACH_LANE(CC_BYTES) };
+    static const cc_word rows = { CC_ROWS };
+    return (cc_bytes) __builtin_shuffle(
+        (cc_word) __builtin_shuffle((cc_bytes) v, bytes), rows);
+#endif
+}
+
+/* Write bytes OFFSET through OFFSET+OLEN-1 of the keystream of each
+   of the CC_BLOCKS contexts at CTX to OBUF, byte OFFSET+P of context
+   L going to OBUF[P*STRIDE + L].  */
+CC_TARGET static void
+CC_FN(chacha20_gen_lanes)(const chacha20_context *ctx, size_t offset,
+                          uint8_t *obuf, size_t olen, size_t stride)
+{
+    const cc_word zero = { 0 };
+    cc_word s[16], x[16];
+    cc_bytes t;
+    uint64_t block;
+    size_t pos;
+    int i, l, c;
+
+    for (i = 0; i < 16; i++)
+        for (l = 0; l < CC_BLOCKS; l++)
+            s[i][l] = ctx[l].input[i];
+
+    for (block = offset / 64; 64 * block < offset + olen; block++)
+    {
+        s[12] = zero + (uint32_t) block;
+        s[13] = zero + (uint32_t) (block >> 32);
+        for (i = 0; i < 16; i++)
+            x[i] = s[i];
+        CC_ROUNDS(x, i);
+
+        for (i = 0; i < 16; i++)
+        {
+            t = CC_FN(cc_rows)(x[i] + s[i]);
+            for (c = 0; c < 4; c++)
+            {
+                pos = 64 * block + 4 * i + c;
+                if (pos >= offset && pos < offset + olen)
+                    memcpy(obuf + (pos - offset) * stride,
+                           (const uint8_t *)&t + c * CC_BLOCKS, CC_BLOCKS);
+            }
+        }
+    }
+}
+
+#undef cc_word
+#undef cc_bytes
+
+#undef CC_EACH_LANE
+#undef CC_LO32
+#undef CC_HI32
+#undef CC_LO64
+#undef CC_HI64
+#undef CC_BYTES
+#undef CC_ROWS
+#undef CC_ROTL
+#undef CC_QR
+#undef CC_ROUNDS
+
+#undef CC_CAT_
+#undef CC_CAT
+#undef CC_FN
+
+#undef CC_ISA
+#undef CC_TARGET
+#undef CC_BLOCKS
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
@@ -0,0 +1,514 @@
+/*
+ * Based on chacha-regs.c version 20080118 by D. J. Bernstein.
+ * Public domain.
+ * As with salsa20.c, the nonce is wired to all bits zero, and words
+ * 12 and 13 of the state are a 64-bit block counter.
+ */
+
+#include "ciphers.h"
+#include "contexts.h"
+
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define U8TO32_LITTLE(p)                        \
+    (((uint32_t) (p)[0]       ) |               \
+     ((uint32_t) (p)[1] <<  8 ) |               \
+     ((uint32_t) (p)[2] << 16 ) |               \
+     ((uint32_t) (p)[3] << 24 ))
+
+#define U32TO8_LITTLE(p, v)                     \
+    do {                                        \
+        (p)[0] = (uint8_t) ((v)      );         \
+        (p)[1] = (uint8_t) ((v) >>  8);         \
+        (p)[2] = (uint8_t) ((v) >> 16);         \
+        (p)[3] = (uint8_t) ((v) >> 24);         \
+    } while (0)
+
+#define ROTATE(v, c) ((uint32_t)((v) << (c)) | ((v) >> (32 - (c))))
+
+#define QUARTERROUND(a, b, c, d) do {           \
+        a += b; d = ROTATE(d ^ a, 16);          \
+        c += d; b = ROTATE(b ^ c, 12);          \
+        a += b; d = ROTATE(d ^ a,  8);          \
+        c += d; b = ROTATE(b ^ c,  7);          \
+    } while (0)
+
+/*
+ * Counter mode has the same four implementations as Salsa20: the
+ * scalar core function below, and SSE2, AVX2 and AVX-512 kernels for
+ * 4, 8 or 16 blocks at a time.  As there, each backend also has a
+ * gen_lanes for gen_keystream_batch, with one context per lane.
+ */
+typedef struct chacha20_backend
+{
+    const char *name;
+    bool (*supported)(void);
+    void (*ctr_blocks)(const chacha20_context *ctx, uint64_t block,
+                       size_t nblocks, uint8_t *obuf);
+    size_t lanes;
+    void (*gen_lanes)(const chacha20_context *ctx, size_t offset,
+                      uint8_t *obuf, size_t olen, size_t stride);
+}
+chacha20_backend;
+
+static const chacha20_backend *chacha20_default_backend(void);
+
+/* The key occupies words 4 through 11; a 128-bit key is used twice.  */
+static void
+chacha20_setup(chacha20_context *ctx, const char constants[16],
+               const uint8_t *k0, const uint8_t *k1)
+{
+    int i;
+
+    ctx->impl = chacha20_default_backend();
+    for (i = 0; i < 4; i++)
+    {
+        ctx->input[i]     = U8TO32_LITTLE(constants + 4*i);
+        ctx->input[4 + i] = U8TO32_LITTLE(k0 + 4*i);
+        ctx->input[8 + i] = U8TO32_LITTLE(k1 + 4*i);
+    }
+    ctx->input[12] = 0;
+    ctx->input[13] = 0;
+    ctx->input[14] = 0;
+    ctx->input[15] = 0;
+}
+
+static void
+chacha20_128_init(void *ctx, const uint8_t *k)
+{
+    chacha20_setup(ctx, "expand 16-byte k", k, k);
+}
+
+static void
+chacha20_256_init(void *ctx, const uint8_t *k)
+{
+    chacha20_setup(ctx, "expand 32-byte k", k, k + 16);
+}
+
+/* The nonce is words 14 and 15, the 64-bit nonce of the original
+   ChaCha.  As with Salsa20, NONCE is the 8-byte nonce read as a
+   little-endian integer.  */
+static void
+chacha20_set_nonce(void *ctx_, uint64_t nonce)
+{
+    chacha20_context *ctx = ctx_;
+    ctx->input[14] = (uint32_t) nonce;
+    ctx->input[15] = (uint32_t) (nonce >> 32);
+}
+
+/* The ChaCha20 core function: like Salsa20's, a 512-bit block
+   function that gen_keystream uses in counter mode.  */
+static void
+chacha20_wordtobyte(uint8_t output[64], const uint32_t input[16])
+{
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, input, sizeof x);
+    for (i = 20; i > 0; i -= 2)
+    {
+        QUARTERROUND(x[ 0], x[ 4], x[ 8], x[12]);
+        QUARTERROUND(x[ 1], x[ 5], x[ 9], x[13]);
+        QUARTERROUND(x[ 2], x[ 6], x[10], x[14]);
+        QUARTERROUND(x[ 3], x[ 7], x[11], x[15]);
+        QUARTERROUND(x[ 0], x[ 5], x[10], x[15]);
+        QUARTERROUND(x[ 1], x[ 6], x[11], x[12]);
+        QUARTERROUND(x[ 2], x[ 7], x[ 8], x[13]);
+        QUARTERROUND(x[ 3], x[ 4], x[ 9], x[14]);
+    }
+    for (i = 0; i < 16; i++)
+        U32TO8_LITTLE(output + 4*i, x[i] + input[i]);
+}
+
+/* Write NBLOCKS consecutive keystream blocks, starting at BLOCK, to
+   OBUF.  */
+static void
+chacha20_ctr_blocks_scalar(const chacha20_context *ctx, uint64_t block,
+                           size_t nblocks, uint8_t *obuf)
+{
+    uint32_t input[16];
+
+    memcpy(input, ctx->input, sizeof input);
+    for (; nblocks; nblocks--, block++, obuf += 64)
+    {
+        input[12] = (uint32_t) block;
+        input[13] = (uint32_t) (block >> 32);
+        chacha20_wordtobyte(obuf, input);
+    }
+}
+
+static void chacha20_gen_keystream(void *ctx, size_t offset,
+                                   uint8_t *obuf, size_t olen);
+
+/* gen_lanes for one context: generate its keystream a few blocks at
+   a time and store it with stride STRIDE.  */
+static void
+chacha20_gen_lanes_scalar(const chacha20_context *ctx, size_t offset,
+                          uint8_t *obuf, size_t olen, size_t stride)
+{
+    uint8_t block[256];
+    size_t i, chunk, done;
+
+    for (done = 0; done < olen; done += chunk)
+    {
+        chunk = olen - done;
+        if (chunk > sizeof block)
+            chunk = sizeof block;
+        chacha20_gen_keystream((void *) ctx, offset + done, block, chunk);
+        for (i = 0; i < chunk; i++)
+            obuf[(done + i) * stride] = block[i];
+    }
+}
+
+#define CC_ISA    avx512
+#define CC_TARGET __attribute__((target("avx512f,avx512bw")))
+#define CC_BLOCKS 16
+#include "chacha20-simd.h"
+
+#define CC_ISA    avx2
+#define CC_TARGET __attribute__((target("avx2")))
+#define CC_BLOCKS 8
+#include "chacha20-simd.h"
+
+#define CC_ISA    sse2
+#define CC_TARGET
+#define CC_BLOCKS 4
+#include "chacha20-simd.h"
+
+static bool
+avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw");
+}
+
+static bool
+avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool
+always_supported(void)
+{
+    return true;
+}
+
+static const chacha20_backend chacha20_backends[] = {
+    { "avx512", avx512_supported, chacha20_ctr_blocks_avx512,
+      16, chacha20_gen_lanes_avx512 },
+    { "avx2",   avx2_supported,   chacha20_ctr_blocks_avx2,
+      8,  chacha20_gen_lanes_avx2 },
+    { "sse2",   always_supported, chacha20_ctr_blocks_sse2,
+      4,  chacha20_gen_lanes_sse2 },
+    { "scalar", always_supported, chacha20_ctr_blocks_scalar,
+      1,  chacha20_gen_lanes_scalar },
+    { 0, 0, 0, 0, 0 }
+};
+
+static const char *const chacha20_impls[] = {
+    "avx512", "avx2", "sse2", "scalar", 0
+};
+
+/* Set by chacha20_use_impl; shared by both key sizes.  */
+static const chacha20_backend *chacha20_forced_backend;
+
+static const chacha20_backend *
+chacha20_default_backend(void)
+{
+    const chacha20_backend *b;
+    if (chacha20_forced_backend)
+        return chacha20_forced_backend;
+    for (b = chacha20_backends; !b->supported(); b++)
+        ;
+    return b;
+}
+
+static bool
+chacha20_use_impl(const char *name)
+{
+    const chacha20_backend *b;
+
+    if (!name)
+    {
+        chacha20_forced_backend = 0;
+        return true;
+    }
+    for (b = chacha20_backends; b->name; b++)
+        if (!strcmp(b->name, name))
+        {
+            if (!b->supported())
+                return false;
+            chacha20_forced_backend = b;
+            return true;
+        }
+    return false;
+}
+
+static const char *
+chacha20_current_impl(void)
+{
+    return chacha20_default_backend()->name;
+}
+
+static void
+chacha20_gen_blocks(void *ctx_, uint64_t block, size_t nblocks,
+                    uint8_t *obuf)
+{
+    const chacha20_context *ctx = ctx_;
+    ctx->impl->ctr_blocks(ctx, block, nblocks, obuf);
+}
+
+static void
+chacha20_gen_keystream(void *ctx, size_t offset, uint8_t *obuf, size_t olen)
+{
+    cipher_ctr_gen_keystream(chacha20_gen_blocks, 64, ctx, offset, obuf, olen);
+}
+
+/* As in salsa20.c: the widest groups of contexts go to the batch's
+   own backend, and any left over to the narrower ones after it.  */
+static void
+chacha20_gen_keystream_batch(void *ctxs, size_t n, size_t offset,
+                             uint8_t *obuf, size_t olen)
+{
+    const chacha20_context *ctx = ctxs;
+    const chacha20_backend *b;
+    size_t k = 0;
+
+    if (n == 0)
+        return;
+    for (b = ctx->impl; b->name; b++)
+        for (; k + b->lanes <= n; k += b->lanes)
+            b->gen_lanes(ctx + k, offset, obuf + k, olen, n);
+}
+
+#define B16_(a,b,c,d, e,f,g,h, i,j,k,l, m,n,o,p)              \
+    0x##a, 0x##b, 0x##c, 0x##d, 0x##e, 0x##f, 0x##g, 0x##h,   \
+    0x##i, 0x##j, 0x##k, 0x##l, 0x##m, 0x##n, 0x##o, 0x##p
+
+#define B16(one) { B16_ one, B16_(0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0) }
+#define B32(one, two) { B16_ one, B16_ two }
+#define B64(one, two, three, four) { B16_ one, B16_ two, B16_ three, B16_ four }
+
+struct chacha20_test_vector
+{
+    uint8_t key[32];
+    unsigned int offset;
+    uint8_t sample[64];
+    uint64_t nonce;
+};
+
+/* draft-strombergson-chacha-test-vectors, TC1 (all-zero key), first
+   two blocks.  As in salsa20.c, a 128-bit key is used twice, so
+   only its first 16 bytes are given here.  */
+static const struct chacha20_test_vector
+chacha20_128_test_vectors[] = {
+    { B16((00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00)),
+        0, B64((89,67,09,52,60,83,64,FD,00,B2,F9,09,36,F0,31,C8),
+                (E7,56,E1,5D,BA,04,B8,49,3D,00,42,92,59,B2,0F,46),
+                (CC,04,F1,11,24,6B,6C,2C,E0,66,BE,3B,FB,32,D9,AA),
+                (0F,DD,FB,C1,21,23,D4,B9,E4,4F,34,DC,A0,5A,10,3F)), 0 },
+    { B16((00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00)),
+       64, B64((6C,D1,35,C2,87,8C,83,2B,58,96,B1,34,F6,14,2A,9D),
+                (4D,8D,0D,8F,10,26,D2,0A,0A,81,51,2C,BC,E6,E9,75),
+                (8A,71,43,D0,21,97,80,22,A3,84,14,1A,80,CE,A3,06),
+                (2F,41,F6,7A,75,2E,66,AD,34,11,98,4C,78,7E,30,AD)), 0 },
+};
+
+/* RFC 7539, appendix A.1, test vectors 1-5.  Those use a 32-bit block
+   counter and a 96-bit nonce, but with counters below 2^32 the state
+   is the same as ours, with the last eight bytes of the nonce as our
+   nonce.  */
+static const struct chacha20_test_vector
+chacha20_256_test_vectors[] = {
+    { B32((00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00),
+          (00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00)),
+        0, B64((76,B8,E0,AD,A0,F1,3D,90,40,5D,6A,E5,53,86,BD,28),
+                (BD,D2,19,B8,A0,8D,ED,1A,A8,36,EF,CC,8B,77,0D,C7),
+                (DA,41,59,7C,51,57,48,8D,77,24,E0,3F,B8,D8,4A,37),
+                (6A,43,B8,F4,15,18,A1,1C,C3,87,B6,69,B2,EE,65,86)), 0 },
+    { B32((00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00),
+          (00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00)),
+       64, B64((9F,07,E7,BE,55,51,38,7A,98,BA,97,7C,73,2D,08,0D),
+                (CB,0F,29,A0,48,E3,65,69,12,C6,53,3E,32,EE,7A,ED),
+                (29,B7,21,76,9C,E6,4E,43,D5,71,33,B0,74,D8,39,D5),
+                (31,ED,1F,28,51,0A,FB,45,AC,E1,0A,1F,4B,79,4D,6F)), 0 },
+    { B32((00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00),
+          (00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,01)),
+       64, B64((3A,EB,52,24,EC,F8,49,92,9B,9D,82,8D,B1,CE,D4,DD),
+                (83,20,25,E8,01,8B,81,60,B8,22,84,F3,C9,49,AA,5A),
+                (8E,CA,00,BB,B4,A7,3B,DA,D1,92,B5,C4,2F,73,F2,FD),
+                (4E,27,36,44,C8,B3,61,25,A6,4A,DD,EB,00,6C,13,A0)), 0 },
+    { B32((00,FF,00,00,00,00,00,00,00,00,00,00,00,00,00,00),
+          (00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00)),
+      128, B64((72,D5,4D,FB,F1,2E,C4,4B,36,26,92,DF,94,13,7F,32),
+                (8F,EA,8D,A7,39,90,26,5E,C1,BB,BE,A1,AE,9A,F0,CA),
+                (13,B2,5A,A2,6C,B4,A6,48,CB,9B,9D,1B,E6,5B,2C,09),
+                (24,A6,6C,54,D5,45,EC,1B,73,74,F4,87,2E,99,F0,96)), 0 },
+    { B32((00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00),
+          (00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00)),
+        0, B64((C2,C6,4D,37,8C,D5,36,37,4A,E2,04,B9,EF,93,3F,CD),
+                (1A,8B,22,88,B3,DF,A4,96,72,AB,76,5B,54,EE,27,C7),
+                (8A,97,0E,0E,95,5C,14,F3,A8,8E,74,1B,97,C2,86,F7),
+                (5F,8F,C2,99,E8,14,83,62,FA,19,8A,39,53,1B,ED,6D)),
+      0x0200000000000000ull },
+};
+
+static void
+dump_hex(const char *label, const uint8_t *p, size_t n)
+{
+    size_t i;
+    fputs(label, stderr);
+    for (i = 0; i < n; i++)
+        fprintf(stderr, "%02x", (unsigned int)p[i]);
+    putc('\n', stderr);
+}
+
+/* As in salsa20.c, each sample is checked both on its own and as part
+   of one long run from offset zero, which goes through the
+   multi-block kernels.  */
+static bool
+chacha20_test_one_size(const chacha20_backend *b, const char *label,
+                       void (*init)(void *, const uint8_t *),
+                       const struct chacha20_test_vector *v, size_t nv)
+{
+    size_t i, j;
+    uint8_t ksbuf[64], run[1024];
+    const uint8_t *got;
+    chacha20_context ctx;
+    bool failed = false;
+
+    for (i = 0; i < nv; i++)
+    {
+        init(&ctx, v[i].key);
+        chacha20_set_nonce(&ctx, v[i].nonce);
+        ctx.impl = b;
+        chacha20_gen_keystream(&ctx, 0, run, sizeof run);
+
+        for (j = 0; j < 2; j++)
+        {
+            if (j)
+                got = run + v[i].offset;
+            else
+            {
+                chacha20_gen_keystream(&ctx, v[i].offset, ksbuf, 64);
+                got = ksbuf;
+            }
+            if (memcmp(got, v[i].sample, 64))
+            {
+                fprintf(stderr,
+                        "FAIL: %s (%s) vector %zu (offset %u%s):\n",
+                        label, b->name, i+1, v[i].offset,
+                        j ? ", long run" : "");
+                dump_hex("  exp: ", v[i].sample, 64);
+                dump_hex("  got: ", got, 64);
+                putc('\n', stderr);
+                failed = true;
+            }
+        }
+    }
+    return failed;
+}
+
+/* Check gen_keystream_batch against each context's own keystream, as
+   salsa20_test_batch does.  */
+#define CHACHA20_TEST_BATCH 19
+#define CHACHA20_TEST_LEN   700
+
+static bool
+chacha20_test_batch(const chacha20_backend *b)
+{
+    chacha20_context ctxs[CHACHA20_TEST_BATCH];
+    uint8_t key[32];
+    uint8_t *got, *exp;
+    size_t n, k, len;
+    bool failed = false;
+
+    got = malloc(CHACHA20_TEST_BATCH * CHACHA20_TEST_LEN);
+    exp = malloc(CHACHA20_TEST_BATCH * CHACHA20_TEST_LEN);
+    if (!got || !exp)
+        abort();
+
+    for (k = 0; k < CHACHA20_TEST_BATCH; k++)
+    {
+        for (n = 0; n < sizeof key; n++)
+            key[n] = (uint8_t)(k * 32 + n);
+        chacha20_256_init(&ctxs[k], key);
+        ctxs[k].impl = b;
+        chacha20_gen_lanes_scalar(&ctxs[k], 37, exp + k, CHACHA20_TEST_LEN,
+                                  CHACHA20_TEST_BATCH);
+    }
+
+    for (n = 0; n < CHACHA20_TEST_LEN; n += len)
+    {
+        len = n % 300 + 1;
+        if (len > CHACHA20_TEST_LEN - n)
+            len = CHACHA20_TEST_LEN - n;
+        chacha20_gen_keystream_batch(ctxs, CHACHA20_TEST_BATCH, 37 + n,
+                                     got + n * CHACHA20_TEST_BATCH, len);
+    }
+
+    for (n = 0; n < CHACHA20_TEST_LEN * CHACHA20_TEST_BATCH; n++)
+        if (got[n] != exp[n])
+        {
+            fprintf(stderr, "FAIL: chacha20 (%s) batch: context %zu "
+                    "offset %zu exp %02x got %02x\n", b->name,
+                    n % CHACHA20_TEST_BATCH, 37 + n / CHACHA20_TEST_BATCH,
+                    exp[n], got[n]);
+            failed = true;
+            break;
+        }
+
+    free(got);
+    free(exp);
+    return failed;
+}
+
+/* Test every backend this CPU can run, not just the default.  */
+static void
+chacha20_selftest(void)
+{
+    const chacha20_backend *b;
+    bool failed = false;
+
+    for (b = chacha20_backends; b->name; b++)
+    {
+        if (!b->supported())
+            continue;
+
+        failed |= chacha20_test_one_size(b, "chacha20_128",
+                                         chacha20_128_init,
+                                         chacha20_128_test_vectors, 2);
+        failed |= chacha20_test_one_size(b, "chacha20_256",
+                                         chacha20_256_init,
+                                         chacha20_256_test_vectors, 5);
+        failed |= chacha20_test_batch(b);
+    }
+    if (failed)
+        abort();
+}
+
+DEFINE_CIPHER(chacha20_128, chacha20, 16,
+              .impls = chacha20_impls, .use_impl = chacha20_use_impl,
+              .current_impl = chacha20_current_impl,
+              .blocksize = 64, .gen_blocks = chacha20_gen_blocks,
+              .gen_keystream_batch = chacha20_gen_keystream_batch,
+              .set_nonce = chacha20_set_nonce);
+DEFINE_CIPHER(chacha20_256, chacha20, 32,
+              .impls = chacha20_impls, .use_impl = chacha20_use_impl,
+              .current_impl = chacha20_current_impl,
+              .blocksize = 64, .gen_blocks = chacha20_gen_blocks,
+              .gen_keystream_batch = chacha20_gen_keystream_batch,
+              .set_nonce = chacha20_set_nonce);
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
@@ -0,0 +1,91 @@
+/*
+ *  RNGstats cipher context layouts.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CIPHERS_CONTEXTS_H__
+#define CIPHERS_CONTEXTS_H__
+
+/* The context of every cipher, PREFIX_context for each PREFIX named
+   in a DEFINE_CIPHER.  They are only for the cipher's own source
+   file to look inside; they are here so that the worker, which is
+   instantiated once per cipher, can give its array of contexts a
+   size fixed at compile time.  */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct aes_backend;
+struct chacha20_backend;
+struct isaac64_backend;
+struct salsa20_backend;
+
+typedef struct
+{
+    const struct aes_backend *impl; /*!<  implementation    */
+    int nr;                     /*!<  number of rounds  */
+    uint32_t *rk;               /*!<  AES round keys    */
+    uint32_t buf[68];           /*!<  unaligned data    */
+    uint64_t nonce;             /*!<  upper half of counter */
+}
+aes_context;
+
+typedef struct
+{
+    size_t offset;
+    int x;
+    int y;
+    uint8_t m[256];
+}
+arc4_context;
+
+typedef struct
+{
+    const struct chacha20_backend *impl;
+    uint32_t input[16];
+}
+chacha20_context;
+
+/* ISAAC64 state is this many words.  */
+#define ISAAC64_RANDSIZ 256
+
+typedef struct
+{
+    const struct isaac64_backend *impl; /* batch layout; see isaac64.c */
+    uint64_t offset, aa, bb, cc;
+    uint64_t mm[ISAAC64_RANDSIZ];
+    uint64_t randrsl[ISAAC64_RANDSIZ];
+}
+isaac64_context;
+
+typedef struct
+{
+    const struct salsa20_backend *impl;
+    uint32_t input[16];
+    size_t offset;
+}
+salsa20_context;
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
@@ -0,0 +1,303 @@
+/*
+ *  Multi-instance ISAAC64, instantiated by isaac64.c once per vector
+ *  width.
+ *
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The includer defines IS_ISA (a suffix for the generated names),
+ * IS_TARGET (function attributes enabling the instruction set),
+ * IS_LANES (contexts per group, 4 or 8), and IS_GATHER(base, index),
+ * which loads the 64-bit words at BASE[INDEX[l]] into lane L.  This
+ * file defines isaac64_init_lanes_<IS_ISA> and
+ * isaac64_gen_lanes_<IS_ISA>, with the signatures of isaac64_backend's
+ * init_lanes and gen_lanes, and undefines the four parameters again.
+ *
+ * A group holds IS_LANES independent generators, interleaved word by
+ * word: word I of lane L's mm[] is at mm[I][L], so one vector load
+ * fetches word I of every lane, and the rounds are the scalar rounds
+ * applied lane-wise.  The only data-dependent accesses are the two
+ * ind() lookups per step, which become gathers whose indices are
+ * scaled by IS_LANES and offset by the lane number, so each lane
+ * only ever reads its own mm[].
+ */
+
+#define IS_CAT_(a, b) a##_##b
+#define IS_CAT(a, b)  IS_CAT_(a, b)
+#define IS_FN(name)   IS_CAT(name, IS_ISA)
+#define IS_INLINE     static inline __attribute__((always_inline)) IS_TARGET
+
+#define is_word      IS_FN(is_word)
+#define is_bytes     IS_FN(is_bytes)
+#define is_group     IS_FN(is_group)
+#define is_load      IS_FN(is_load)
+#define is_store     IS_FN(is_store)
+#define is_core_with IS_FN(is_core_with)
+#define is_core      IS_FN(is_core)
+#define is_discard   IS_FN(is_discard)
+#define is_emit      IS_FN(is_emit)
+
+typedef uint64_t is_word __attribute__((vector_size(8 * IS_LANES)));
+typedef uint8_t is_bytes __attribute__((vector_size(8 * IS_LANES)));
+
+typedef struct
+{
+    const struct isaac64_backend *impl;
+    uint64_t offset;
+    uint64_t aa[IS_LANES], bb[IS_LANES], cc[IS_LANES];
+    uint64_t mm[RANDSIZ][IS_LANES];
+    uint64_t randrsl[RANDSIZ][IS_LANES];
+}
+is_group;
+
+_Static_assert(sizeof(is_group) <= IS_LANES * sizeof(isaac64_context),
+               "a group must fit in the contexts it replaces");
+
+IS_INLINE is_word
+is_load(const uint64_t *p)
+{
+    is_word w;
+    memcpy(&w, p, sizeof w);
+    return w;
+}
+
+IS_INLINE void
+is_store(uint64_t *p, is_word w)
+{
+    memcpy(p, &w, sizeof w);
+}
+
+#define IS_STEP(mix, i) do {                                            \
+        x = is_load(grp->mm[i]);                                        \
+        a = (mix) + is_load(grp->mm[((i) + RANDSIZ/2) % RANDSIZ]);      \
+        y = IS_GATHER(grp->mm,                                          \
+                      ((x >> 3) & (RANDSIZ-1)) * IS_LANES + lane)       \
+            + a + b;                                                    \
+        is_store(grp->mm[i], y);                                        \
+        b = IS_GATHER(grp->mm,                                          \
+                      ((y >> (RANDSIZL+3)) & (RANDSIZ-1)) * IS_LANES    \
+                      + lane)                                           \
+            + x;                                                        \
+        if (emit)                                                       \
+            is_store(grp->randrsl[i], b);                               \
+    } while (0)
+
+/* isaac64_core_with for every lane.  */
+IS_INLINE void
+is_core_with(is_group *grp, bool emit)
+{
+    is_word a, b, c, x, y, lane;
+    int i;
+
+    for (i = 0; i < IS_LANES; i++)
+        lane[i] = (uint64_t) i;
+
+    c = is_load(grp->cc) + 1;
+    is_store(grp->cc, c);
+    a = is_load(grp->aa);
+    b = is_load(grp->bb) + c;
+    for (i = 0; i < RANDSIZ; i += 4)
+    {
+        IS_STEP(~(a ^ (a << 21)), i + 0);
+        IS_STEP(  a ^ (a >> 5)  , i + 1);
+        IS_STEP(  a ^ (a << 12) , i + 2);
+        IS_STEP(  a ^ (a >> 33) , i + 3);
+    }
+    is_store(grp->bb, b);
+    is_store(grp->aa, a);
+}
+
+#undef IS_STEP
+
+IS_TARGET static void
+is_core(is_group *grp)
+{
+    is_core_with(grp, true);
+}
+
+IS_TARGET static void
+is_discard(is_group *grp)
+{
+    is_core_with(grp, false);
+}
+
+/* isaac64_init for every lane.  Key L is at KEYS + 16*L.  */
+IS_TARGET static void
+IS_FN(isaac64_init_lanes)(const struct isaac64_backend *impl,
+                          void *grp_, const uint8_t *keys)
+{
+    is_group *grp = grp_;
+    const is_word zero = { 0 };
+    is_word a, b, c, d, e, f, g, h, k0, k1;
+    int i, l;
+
+    for (l = 0; l < IS_LANES; l++)
+    {
+        memcpy(&k0[l], keys + 16*l, 8);
+        memcpy(&k1[l], keys + 16*l + 8, 8);
+    }
+
+    a = b = c = d = e = f = g = h = zero + 0x9e3779b97f4a7c13ull;
+    for (i = 0; i < 4; i++)
+        mix(a,b,c,d,e,f,g,h);
+
+    /* The seed is the key repeated, so its even words are all K0 and
+       its odd words all K1.  */
+    for (i = 0; i < RANDSIZ; i += 8)
+    {
+        a+=k0; b+=k1; c+=k0; d+=k1; e+=k0; f+=k1; g+=k0; h+=k1;
+        mix(a,b,c,d,e,f,g,h);
+        is_store(grp->mm[i  ], a); is_store(grp->mm[i+1], b);
+        is_store(grp->mm[i+2], c); is_store(grp->mm[i+3], d);
+        is_store(grp->mm[i+4], e); is_store(grp->mm[i+5], f);
+        is_store(grp->mm[i+6], g); is_store(grp->mm[i+7], h);
+    }
+
+    for (i = 0; i < RANDSIZ; i += 8)
+    {
+        a+=is_load(grp->mm[i  ]); b+=is_load(grp->mm[i+1]);
+        c+=is_load(grp->mm[i+2]); d+=is_load(grp->mm[i+3]);
+        e+=is_load(grp->mm[i+4]); f+=is_load(grp->mm[i+5]);
+        g+=is_load(grp->mm[i+6]); h+=is_load(grp->mm[i+7]);
+        mix(a,b,c,d,e,f,g,h);
+        is_store(grp->mm[i  ], a); is_store(grp->mm[i+1], b);
+        is_store(grp->mm[i+2], c); is_store(grp->mm[i+3], d);
+        is_store(grp->mm[i+4], e); is_store(grp->mm[i+5], f);
+        is_store(grp->mm[i+6], g); is_store(grp->mm[i+7], h);
+    }
+
+    memset(grp->aa, 0, sizeof grp->aa);
+    memset(grp->bb, 0, sizeof grp->bb);
+    memset(grp->cc, 0, sizeof grp->cc);
+    grp->offset = 0;
+    grp->impl = impl;
+    is_core(grp);
+}
+
+#if IS_LANES == 4
+#define IS_T(b) 7-b, 15-b, 23-b, 31-b
+#elif IS_LANES == 8
+#define IS_T(b) 7-b, 15-b, 23-b, 31-b, 39-b, 47-b, 55-b, 63-b
+#else
+#error "IS_LANES must be 4 or 8"
+#endif
+
+/* Write words W .. W+NWORDS-1 of every lane's page, big-endian, to
+   the position-major OBUF: byte B of word W+I of lane L goes to
+   OBUF[(8*I + B)*STRIDE + L].  Each word is a byte transpose of one
+   vector, after which every row can be stored in one piece.  */
+IS_INLINE void
+is_emit(const is_group *grp, size_t w, size_t nwords,
+        uint8_t *obuf, size_t stride)
+{
+    static const is_bytes transpose = {
+        IS_T(0), IS_T(1), IS_T(2), IS_T(3),
+        IS_T(4), IS_T(5), IS_T(6), IS_T(7)
+    };
+    is_bytes t;
+    size_t i, b;
+
+    for (i = 0; i < nwords; i++, obuf += 8*stride)
+    {
+        t = __builtin_shuffle((is_bytes) is_load(grp->randrsl[w + i]),
+                              transpose);
+        for (b = 0; b < 8; b++)
+            memcpy(obuf + b*stride, (const uint8_t *)&t + b*IS_LANES,
+                   IS_LANES);
+    }
+}
+
+#undef IS_T
+
+/* isaac64_gen_keystream for every lane, with the same invariant:
+   randrsl[] holds the page containing byte grp->offset.  */
+IS_TARGET static void
+IS_FN(isaac64_gen_lanes)(void *grp_, size_t offset,
+                         uint8_t *obuf, size_t olen, size_t stride)
+{
+    is_group *grp = grp_;
+    size_t page, pos, n, i, l;
+
+    if (offset < grp->offset)
+        abort();
+
+    for (page = grp->offset / RANDSIZB; page + 1 < offset / RANDSIZB; page++)
+        is_discard(grp);
+    if (page < offset / RANDSIZB)
+        is_core(grp);
+    grp->offset = offset + olen;
+
+    pos = offset % RANDSIZB;
+    while (olen)
+    {
+        if (pos % 8 == 0 && olen >= 8)
+        {
+            n = (RANDSIZB - pos) / 8;
+            if (n > olen / 8)
+                n = olen / 8;
+            is_emit(grp, pos / 8, n, obuf, stride);
+            n *= 8;
+        }
+        else
+        {
+            n = 8 - pos % 8;
+            if (n > olen)
+                n = olen;
+            for (i = 0; i < n; i++)
+                for (l = 0; l < IS_LANES; l++)
+                    obuf[i*stride + l] = (uint8_t)
+                        (grp->randrsl[pos / 8][l] >> (56 - 8*(pos%8 + i)));
+        }
+        obuf += n * stride;
+        olen -= n;
+        pos += n;
+        if (pos == RANDSIZB)
+        {
+            is_core(grp);
+            pos = 0;
+        }
+    }
+}
+
+#undef is_word
+#undef is_bytes
+#undef is_group
+#undef is_load
+#undef is_store
+#undef is_core_with
+#undef is_core
+#undef is_discard
+#undef is_emit
+
+#undef IS_CAT_
+#undef IS_CAT
+#undef IS_FN
+#undef IS_INLINE
+
+#undef IS_ISA
+#undef IS_TARGET
+#undef IS_LANES
+#undef IS_GATHER
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
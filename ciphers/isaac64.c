@@ -6,25 +6,23 @@ By Bob Jenkins, 1996.  Public Domain.
 */
 
 #include "ciphers.h"
+#include "contexts.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <immintrin.h>
+
 _Static_assert(sizeof(uint64_t) == 8, "size sanity check");
 
 #define RANDSIZL   (8)
 #define RANDSIZ    (1<<RANDSIZL)
 #define RANDSIZB   (RANDSIZ * sizeof(uint64_t))
 
-typedef struct
-{
-    uint64_t offset, aa, bb, cc;
-    uint64_t mm[RANDSIZ];
-    uint64_t randrsl[RANDSIZ];
-}
-isaac64_context;
+_Static_assert(RANDSIZ == ISAAC64_RANDSIZ, "isaac64_context size");
 
 #define ind(mm,x)  (*(uint64_t *)((uint8_t *)(mm) + ((x) & ((RANDSIZ-1)<<3))))
 
@@ -32,7 +30,9 @@ isaac64_context;
         x = *m;                                 \
         a = (mix) + *(m2++);                    \
         *(m++) = y = ind(mm,x) + a + b;         \
-        *(r++) = b = ind(mm,y>>RANDSIZL) + x;   \
+        b = ind(mm,y>>RANDSIZL) + x;            \
+        if (r)                                  \
+            *(r++) = b;                         \
     } while (0)
 
 #define mix(a,b,c,d,e,f,g,h) do {               \
@@ -59,13 +59,14 @@ isaac64_context;
 
 /* The ISAAC64 core function emits RANDSIZ 64-bit words of randomness
    all at once.  They are saved in the context, and isaac64_gen_keystream
-   pulls them out one at a time.  */
-static void
-isaac64_core(isaac64_context *ctx)
+   pulls them out one at a time.  With EMIT false, it only advances the
+   state past them, which is all that seeking forward needs.  */
+static inline __attribute__((always_inline)) void
+isaac64_core_with(isaac64_context *ctx, bool emit)
 {
     uint64_t a,b,x,y,*m,*m2,*mm,*r,*mend;
     mm = ctx->mm;
-    r  = ctx->randrsl;
+    r  = emit ? ctx->randrsl : 0;
     a  = ctx->aa;
     b  = ctx->bb + (++ctx->cc);
     for (m = ctx->mm, mend = m2 = m+(RANDSIZ/2); m<mend; )
@@ -86,6 +87,18 @@ isaac64_core(isaac64_context *ctx)
     ctx->aa = a;
 }
 
+static void
+isaac64_core(isaac64_context *ctx)
+{
+    isaac64_core_with(ctx, true);
+}
+
+static void
+isaac64_discard(isaac64_context *ctx)
+{
+    isaac64_core_with(ctx, false);
+}
+
 static void
 isaac64_init(void *ctx_, const uint8_t *key)
 {
@@ -134,49 +147,335 @@ isaac64_init(void *ctx_, const uint8_t *key)
     isaac64_core(ctx);
 }
 
+/* Store the NWORDS words at R to OBUF as big-endian bytes.  */
+static void
+isaac64_emit_words_scalar(const uint64_t *r, size_t nwords, uint8_t *obuf)
+{
+    size_t i;
+    uint64_t v;
+
+    for (i = 0; i < nwords; i++)
+    {
+        v = r[i];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        memcpy(obuf + 8*i, &v, 8);
+    }
+}
+
+/* The same, byte-swapping two words at a time with PSHUFB.  */
+__attribute__((target("ssse3"))) static void
+isaac64_emit_words_ssse3(const uint64_t *r, size_t nwords, uint8_t *obuf)
+{
+    const __m128i swap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                      0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i;
+
+    for (i = 0; i + 2 <= nwords; i += 2)
+        _mm_storeu_si128((__m128i *)(obuf + 8*i),
+                         _mm_shuffle_epi8(
+                             _mm_loadu_si128((const __m128i *)(r + i)),
+                             swap));
+    isaac64_emit_words_scalar(r + i, nwords - i, obuf + 8*i);
+}
+
+/* And four at a time.  VPSHUFB shuffles within each 128-bit lane, so
+   the mask is the SSSE3 one twice.  */
+__attribute__((target("avx2"))) static void
+isaac64_emit_words_avx2(const uint64_t *r, size_t nwords, uint8_t *obuf)
+{
+    const __m256i swap = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                         0, 1, 2, 3, 4, 5, 6, 7,
+                                         8, 9, 10, 11, 12, 13, 14, 15,
+                                         0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i;
+
+    for (i = 0; i + 4 <= nwords; i += 4)
+        _mm256_storeu_si256((__m256i *)(obuf + 8*i),
+                            _mm256_shuffle_epi8(
+                                _mm256_loadu_si256((const __m256i *)(r + i)),
+                                swap));
+    isaac64_emit_words_scalar(r + i, nwords - i, obuf + 8*i);
+}
+
+static bool
+avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw");
+}
+
+static bool
+avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool
+ssse3_supported(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+static bool
+always_supported(void)
+{
+    return true;
+}
+
+/* The byte swap is used by every context that is not part of a SIMD
+   group (see below), whichever backend laid out the batch, so it is
+   chosen on its own: the widest one the CPU supports.  */
+static const struct
+{
+    const char *name;
+    bool (*supported)(void);
+    void (*emit)(const uint64_t *r, size_t nwords, uint8_t *obuf);
+}
+isaac64_emitters[] = {
+    { "avx2",   avx2_supported,   isaac64_emit_words_avx2   },
+    { "ssse3",  ssse3_supported,  isaac64_emit_words_ssse3  },
+    { "scalar", always_supported, isaac64_emit_words_scalar },
+    { 0, 0, 0 }
+};
+
+static void (*isaac64_emit)(const uint64_t *r, size_t nwords, uint8_t *obuf);
+
+static void
+choose_emitter(void)
+{
+    size_t i;
+
+    for (i = 0; !isaac64_emitters[i].supported(); i++)
+        ;
+    isaac64_emit = isaac64_emitters[i].emit;
+}
+
+static void
+isaac64_emit_words(const uint64_t *r, size_t nwords, uint8_t *obuf)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, choose_emitter);
+    isaac64_emit(r, nwords, obuf);
+}
+
+/* randrsl[] always holds the page containing byte ctx->offset of the
+   keystream; in particular, it is refilled as soon as the last byte
+   of a page has been consumed.  */
 static void
 isaac64_gen_keystream(void *ctx_, size_t offset, uint8_t *obuf, size_t olen)
 {
     isaac64_context *ctx = ctx_;
-    size_t offset_RANDSIZ, offset_64b, offset_rem;
+    size_t page, pos, n;
     uint8_t buf[8];
-    uint8_t *limit = obuf + olen;
 
     if (offset < ctx->offset)
         abort();
 
-    offset_RANDSIZ = offset / RANDSIZB;
-    while (ctx->offset < offset_RANDSIZ)
-    {
+    /* Only the page containing OFFSET needs to be kept.  */
+    for (page = ctx->offset / RANDSIZB; page + 1 < offset / RANDSIZB; page++)
+        isaac64_discard(ctx);
+    if (page < offset / RANDSIZB)
         isaac64_core(ctx);
-        ctx->offset += RANDSIZB;
-    }
+    ctx->offset = offset + olen;
 
-    offset_64b = (offset % RANDSIZB) / 8;
-    offset_rem = (offset % RANDSIZB) % 8;
-    for (;;)
+    pos = offset % RANDSIZB;
+    while (olen)
     {
-        for (; offset_64b < RANDSIZ; offset_64b++)
+        if (pos % 8 == 0 && olen >= 8)
         {
-            cpu_to_be64(buf, ctx->randrsl[offset_64b]);
-            for (; offset_rem < 8; offset_rem++)
-            {
-                *obuf++ = buf[offset_rem];
-                if (obuf >= limit)
-                    goto out;
-            }
-            offset_rem = 0;
+            /* Whole words, up to the end of the page.  */
+            n = (RANDSIZB - pos) / 8;
+            if (n > olen / 8)
+                n = olen / 8;
+            isaac64_emit_words(ctx->randrsl + pos / 8, n, obuf);
+            n *= 8;
+        }
+        else
+        {
+            /* Part of one word, at the beginning or end.  */
+            cpu_to_be64(buf, ctx->randrsl[pos / 8]);
+            n = 8 - pos % 8;
+            if (n > olen)
+                n = olen;
+            memcpy(obuf, buf + pos % 8, n);
+        }
+        obuf += n;
+        olen -= n;
+        pos += n;
+        if (pos == RANDSIZB)
+        {
+            isaac64_core(ctx);
+            pos = 0;
         }
-        offset_64b = 0;
-        isaac64_core(ctx);
     }
- out:
-    ctx->offset = offset + olen;
-    /* since the isaac64_core() call is at the bottom of the outer loop,
-       if we get here exactly at a page boundary, we need to call it once
-       more to maintain the invariant that randrsl[] is full on entry */
-    if (ctx->offset % RANDSIZB == 0)
-        isaac64_core(ctx);
+}
+
+/*
+ * Batches of contexts can be run several to a vector register.  The
+ * batch is divided into groups of LANES contexts, each laid out as
+ * the backend likes, followed by any leftover contexts as ordinary
+ * isaac64_contexts.  Group and context alike begin with a pointer to
+ * the backend that laid out the batch, so gen_keystream_batch can
+ * tell how it was divided.
+ */
+typedef struct isaac64_backend
+{
+    const char *name;
+    bool (*supported)(void);
+    size_t lanes;
+    void (*init_lanes)(const struct isaac64_backend *impl,
+                       void *grp, const uint8_t *keys);
+    void (*gen_lanes)(void *grp, size_t offset,
+                      uint8_t *obuf, size_t olen, size_t stride);
+}
+isaac64_backend;
+
+static void
+isaac64_init_lanes_scalar(const isaac64_backend *impl,
+                          void *ctx_, const uint8_t *key)
+{
+    isaac64_context *ctx = ctx_;
+    isaac64_init(ctx, key);
+    ctx->impl = impl;
+}
+
+/* Generate one context's keystream a page at a time, and spread it
+   across OBUF with the given STRIDE.  */
+static void
+isaac64_gen_lanes_scalar(void *ctx, size_t offset,
+                         uint8_t *obuf, size_t olen, size_t stride)
+{
+    uint8_t block[RANDSIZB];
+    size_t i, chunk, done;
+
+    for (done = 0; done < olen; done += chunk)
+    {
+        chunk = olen - done;
+        if (chunk > sizeof block)
+            chunk = sizeof block;
+        isaac64_gen_keystream(ctx, offset + done, block, chunk);
+        for (i = 0; i < chunk; i++)
+            obuf[(done + i) * stride] = block[i];
+    }
+}
+
+/* AVX-512: eight contexts per group.  AVX512BW is needed for a fast
+   byte transpose of the output.  */
+#define IS_ISA    avx512
+#define IS_TARGET __attribute__((target("avx512f,avx512bw")))
+#define IS_LANES  8
+#define IS_GATHER(base, index) \
+    ((is_word) _mm512_i64gather_epi64((__m512i) (index), (base), 8))
+#include "isaac64-simd.h"
+
+/* AVX2: four contexts per group.  */
+#define IS_ISA    avx2
+#define IS_TARGET __attribute__((target("avx2")))
+#define IS_LANES  4
+#define IS_GATHER(base, index) \
+    ((is_word) _mm256_i64gather_epi64((const long long *) (base), \
+                                      (__m256i) (index), 8))
+#include "isaac64-simd.h"
+
+static const isaac64_backend isaac64_backends[] = {
+    { "avx512", avx512_supported, 8,
+      isaac64_init_lanes_avx512, isaac64_gen_lanes_avx512 },
+    { "avx2",   avx2_supported,   4,
+      isaac64_init_lanes_avx2,   isaac64_gen_lanes_avx2 },
+    { "scalar", always_supported, 1,
+      isaac64_init_lanes_scalar, isaac64_gen_lanes_scalar },
+    { 0, 0, 0, 0, 0 }
+};
+
+static const char *const isaac64_impls[] = {
+    "avx512", "avx2", "scalar", 0
+};
+
+/* The scalar backend, used for leftover contexts.  */
+static const isaac64_backend *const isaac64_scalar_backend =
+    &isaac64_backends[2];
+
+/* Set by isaac64_use_impl.  */
+static const isaac64_backend *isaac64_forced_backend;
+
+static const isaac64_backend *
+isaac64_default_backend(void)
+{
+    const isaac64_backend *b;
+    if (isaac64_forced_backend)
+        return isaac64_forced_backend;
+    for (b = isaac64_backends; !b->supported(); b++)
+        ;
+    return b;
+}
+
+static bool
+isaac64_use_impl(const char *name)
+{
+    const isaac64_backend *b;
+
+    if (!name)
+    {
+        isaac64_forced_backend = 0;
+        return true;
+    }
+    for (b = isaac64_backends; b->name; b++)
+        if (!strcmp(b->name, name))
+        {
+            if (!b->supported())
+                return false;
+            isaac64_forced_backend = b;
+            return true;
+        }
+    return false;
+}
+
+static const char *
+isaac64_current_impl(void)
+{
+    return isaac64_default_backend()->name;
+}
+
+static void
+isaac64_init_batch_with(const isaac64_backend *b, void *ctxs,
+                        const uint8_t *keys, size_t n)
+{
+    uint8_t *ctx = ctxs;
+    size_t k;
+
+    for (k = 0; k + b->lanes <= n; k += b->lanes)
+        b->init_lanes(b, ctx + k * sizeof(isaac64_context), keys + 16*k);
+    for (; k < n; k++)
+        isaac64_init_lanes_scalar(b, ctx + k * sizeof(isaac64_context),
+                                  keys + 16*k);
+}
+
+static void
+isaac64_init_batch(void *ctxs, const uint8_t *keys, size_t n)
+{
+    isaac64_init_batch_with(isaac64_default_backend(), ctxs, keys, n);
+}
+
+static void
+isaac64_gen_keystream_batch(void *ctxs, size_t n, size_t offset,
+                            uint8_t *obuf, size_t olen)
+{
+    uint8_t *ctx = ctxs;
+    const isaac64_backend *b;
+    size_t k;
+
+    if (n == 0)
+        return;
+    memcpy(&b, ctxs, sizeof b);
+
+    for (k = 0; k + b->lanes <= n; k += b->lanes)
+        b->gen_lanes(ctx + k * sizeof(isaac64_context),
+                     offset, obuf + k, olen, n);
+    for (; k < n; k++)
+        isaac64_scalar_backend->gen_lanes(ctx + k * sizeof(isaac64_context),
+                                          offset, obuf + k, olen, n);
 }
 
 #define R(a,b,c,d) RR(a), RR(b), RR(c), RR(d)
@@ -326,31 +625,208 @@ isaac64_test_keystream[] = {
     R(993e1de72d36d310, a2853b80f17f58ee, 1877b51e57a764d5, 001f837cc7350524),
 };
 
+/* Check every backend this CPU can run against the scalar code, for
+   enough contexts to fill two groups of the widest backend and leave
+   a partial one.  Context 0 has the test key.  The keystream is read
+   in pieces of varying size, starting one page in, as above.  */
+#define ISAAC64_TEST_BATCH 19
+#define ISAAC64_TEST_LEN   (3 * RANDSIZB)
+
 static void
-isaac64_selftest(void)
+isaac64_selftest_batch(void)
 {
+    const isaac64_backend *b;
+    uint8_t keys[ISAAC64_TEST_BATCH][16];
+    uint8_t *ctxs, *got, *exp;
     isaac64_context ctx;
-    uint8_t stream[sizeof isaac64_test_keystream];
-    size_t n;
+    size_t n, k, len;
+    bool failed = false;
+
+    ctxs = malloc(ISAAC64_TEST_BATCH * sizeof(isaac64_context));
+    got = malloc(ISAAC64_TEST_BATCH * ISAAC64_TEST_LEN);
+    exp = malloc(ISAAC64_TEST_BATCH * ISAAC64_TEST_LEN);
+    if (!ctxs || !got || !exp)
+        abort();
+
+    for (k = 0; k < ISAAC64_TEST_BATCH; k++)
+        for (n = 0; n < 16; n++)
+            keys[k][n] = k ? (uint8_t)(k * 16 + n) : isaac64_test_key[n];
+
+    for (k = 0; k < ISAAC64_TEST_BATCH; k++)
+    {
+        isaac64_init(&ctx, keys[k]);
+        isaac64_gen_lanes_scalar(&ctx, RANDSIZB, exp + k,
+                                 ISAAC64_TEST_LEN, ISAAC64_TEST_BATCH);
+    }
+
+    for (b = isaac64_backends; b->name; b++)
+    {
+        if (!b->supported())
+            continue;
+
+        isaac64_init_batch_with(b, ctxs, &keys[0][0], ISAAC64_TEST_BATCH);
+        for (n = 0; n < ISAAC64_TEST_LEN; n += len)
+        {
+            len = n % 1500 + 1;
+            if (len > ISAAC64_TEST_LEN - n)
+                len = ISAAC64_TEST_LEN - n;
+            isaac64_gen_keystream_batch(ctxs, ISAAC64_TEST_BATCH,
+                                        RANDSIZB + n,
+                                        got + n * ISAAC64_TEST_BATCH, len);
+        }
+
+        for (n = 0; n < ISAAC64_TEST_LEN; n++)
+            for (k = 0; k < ISAAC64_TEST_BATCH; k++)
+                if (got[n * ISAAC64_TEST_BATCH + k]
+                    != exp[n * ISAAC64_TEST_BATCH + k])
+                {
+                    fprintf(stderr, "FAIL: isaac64 (%s): context %zu "
+                            "offset %zu exp %02x got %02x\n",
+                            b->name, k, n,
+                            exp[n * ISAAC64_TEST_BATCH + k],
+                            got[n * ISAAC64_TEST_BATCH + k]);
+                    failed = true;
+                    n = ISAAC64_TEST_LEN;
+                    break;
+                }
+    }
+
+    free(ctxs);
+    free(got);
+    free(exp);
+    if (failed)
+        abort();
+}
+
+/* Check that seeking ahead on one scalar context, which throws whole
+   pages away with isaac64_discard, lands on the same keystream as
+   reading every page.  The batch test above never skips a page, and
+   on a CPU with a SIMD backend it doesn't run the scalar code on a
+   batch at all.  Each piece after the first skips at least two
+   pages.  */
+#define ISAAC64_SEEK_PAGES 11
+
+static void
+isaac64_selftest_seek(void)
+{
+    static const size_t pieces[][2] = {
+        { 5, 300 },
+        { 3 * RANDSIZB + 17, 64 },
+        { 7 * RANDSIZB - 3, 40 },
+        { 10 * RANDSIZB + 100, 1 },
+    };
+    isaac64_context ctx;
+    uint8_t *exp, got[300];
+    size_t p, n;
     bool failed = false;
 
+    exp = malloc(ISAAC64_SEEK_PAGES * RANDSIZB);
+    if (!exp)
+        abort();
+
+    isaac64_init(&ctx, isaac64_test_key);
+    isaac64_gen_keystream(&ctx, 0, exp, ISAAC64_SEEK_PAGES * RANDSIZB);
+
     isaac64_init(&ctx, isaac64_test_key);
-    isaac64_gen_keystream(&ctx, RANDSIZB, stream,
-                          sizeof isaac64_test_keystream);
-    for (n = 0; n < sizeof isaac64_test_keystream; n++)
-        if (isaac64_test_keystream[n] != stream[n])
+    for (p = 0; p < sizeof pieces / sizeof pieces[0]; p++)
+    {
+        isaac64_gen_keystream(&ctx, pieces[p][0], got, pieces[p][1]);
+        for (n = 0; n < pieces[p][1]; n++)
+            if (got[n] != exp[pieces[p][0] + n])
+            {
+                fprintf(stderr, "FAIL: isaac64: seek to offset %zu "
+                        "exp %02x got %02x\n", pieces[p][0] + n,
+                        exp[pieces[p][0] + n], got[n]);
+                failed = true;
+                break;
+            }
+    }
+
+    free(exp);
+    if (failed)
+        abort();
+}
+
+/* Check every byte swap this CPU can run against the scalar one, for
+   every number of words up to a page, stored at an odd address.  The
+   tests above only see the one that was chosen.  */
+static void
+isaac64_selftest_emit(void)
+{
+    uint64_t words[RANDSIZ];
+    uint8_t exp[RANDSIZB + 1], got[RANDSIZB + 1];
+    size_t e, i, n;
+
+    for (i = 0; i < RANDSIZ; i++)
+        words[i] = 0x0123456789abcdefull * (i + 1);
+
+    for (e = 0; isaac64_emitters[e].name; e++)
+    {
+        if (!isaac64_emitters[e].supported())
+            continue;
+        for (n = 0; n <= RANDSIZ; n++)
         {
-            fprintf(stderr,
-                    "FAIL: isaac64: offset %zu exp %02x got %02x\n",
-                    n, isaac64_test_keystream[n], stream[n]);
-            failed = true;
+            isaac64_emit_words_scalar(words, n, exp + 1);
+            isaac64_emitters[e].emit(words, n, got + 1);
+            if (memcmp(exp + 1, got + 1, 8 * n))
+            {
+                fprintf(stderr, "FAIL: isaac64: %s byte swap of %zu "
+                        "words\n", isaac64_emitters[e].name, n);
+                abort();
+            }
         }
+    }
+}
+
+static void
+isaac64_selftest(void)
+{
+    isaac64_context ctx;
+    uint8_t stream[sizeof isaac64_test_keystream];
+    size_t n, k, pass;
+    bool failed = false;
+
+    /* Read the expected keystream in one go, and then again in pieces
+       of varying size and alignment, which exercises the partial-word
+       path and page crossings in the middle of a call.  */
+    for (pass = 0; pass < 2; pass++)
+    {
+        isaac64_init(&ctx, isaac64_test_key);
+        if (pass == 0)
+            isaac64_gen_keystream(&ctx, RANDSIZB, stream,
+                                  sizeof isaac64_test_keystream);
+        else
+            for (n = 0; n < sizeof isaac64_test_keystream; n += k)
+            {
+                k = n % 37 + 1;
+                if (k > sizeof isaac64_test_keystream - n)
+                    k = sizeof isaac64_test_keystream - n;
+                isaac64_gen_keystream(&ctx, RANDSIZB + n, stream + n, k);
+            }
+
+        for (n = 0; n < sizeof isaac64_test_keystream; n++)
+            if (isaac64_test_keystream[n] != stream[n])
+            {
+                fprintf(stderr, "FAIL: isaac64: pass %zu offset %zu "
+                        "exp %02x got %02x\n",
+                        pass, n, isaac64_test_keystream[n], stream[n]);
+                failed = true;
+            }
+    }
 
     if (failed)
         abort();
+
+    isaac64_selftest_seek();
+    isaac64_selftest_batch();
+    isaac64_selftest_emit();
 }
 
-DEFINE_CIPHER(isaac64, isaac64, 16);
+DEFINE_CIPHER(isaac64, isaac64, 16,
+              .init_batch = isaac64_init_batch,
+              .gen_keystream_batch = isaac64_gen_keystream_batch,
+              .impls = isaac64_impls, .use_impl = isaac64_use_impl,
+              .current_impl = isaac64_current_impl);
 
 /*
  * Local Variables:
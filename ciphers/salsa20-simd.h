@@ -0,0 +1,246 @@
+/*
+ *  Multi-block Salsa20 kernel, instantiated by salsa20.c once per
+ *  vector width.
+ *
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The includer defines SS_ISA (a suffix for the generated names),
+ * SS_TARGET (function attributes enabling the instruction set), and
+ * SS_BLOCKS (blocks per call: 4, 8 or 16, one per 32-bit vector
+ * lane).  This file defines salsa20_ctr_blocks_<SS_ISA> and
+ * salsa20_gen_lanes_<SS_ISA>, with the signatures of salsa20_backend's
+ * ctr_blocks and gen_lanes, and undefines the three parameters again.
+ *
+ * Register I holds word I of the state of every lane, so the rounds
+ * are exactly the scalar rounds applied lane-wise and no shuffles are
+ * needed until the end.  In ctr_blocks the lanes are consecutive
+ * blocks of one key.  The output is transposed four words by four
+ * blocks at a time, within each 128-bit lane, which leaves every lane
+ * holding a 16-byte run of one block that can be stored straight into
+ * the output buffer.  In gen_lanes the lanes are the same block of
+ * SS_BLOCKS different keys, which is what the worker's batches need:
+ * it only asks for 256 bytes, four blocks, of each key at a time.
+ * Each word is transposed into four rows of one byte per key, which
+ * are stored straight into the position-major output.
+ */
+
+#define SS_CAT_(a, b) a##_##b
+#define SS_CAT(a, b)  SS_CAT_(a, b)
+#define SS_FN(name)   SS_CAT(name, SS_ISA)
+
+#define ss_word  SS_FN(ss_word)
+#define ss_bytes SS_FN(ss_bytes)
+
+typedef uint32_t ss_word __attribute__((vector_size(4 * SS_BLOCKS)));
+typedef uint8_t ss_bytes __attribute__((vector_size(4 * SS_BLOCKS)));
+
+/* Shuffle masks are built one 128-bit lane at a time.  */
+#if SS_BLOCKS == 4
+#define SS_EACH_LANE(f) f(0)
+#elif SS_BLOCKS == 8
+#define SS_EACH_LANE(f) f(0), f(1)
+#define SS_ROWS         0, 4, 1, 5, 2, 6, 3, 7
+#elif SS_BLOCKS == 16
+#define SS_EACH_LANE(f) f(0), f(1), f(2), f(3)
+#define SS_ROWS         0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15
+#else
+#error "SS_BLOCKS must be 4, 8 or 16"
+#endif
+
+#define SS_LO32(q) 4*q,   SS_BLOCKS+4*q,   4*q+1, SS_BLOCKS+4*q+1
+#define SS_HI32(q) 4*q+2, SS_BLOCKS+4*q+2, 4*q+3, SS_BLOCKS+4*q+3
+#define SS_LO64(q) 4*q,   4*q+1,   SS_BLOCKS+4*q,   SS_BLOCKS+4*q+1
+#define SS_HI64(q) 4*q+2, 4*q+3,   SS_BLOCKS+4*q+2, SS_BLOCKS+4*q+3
+#define SS_BYTES(q) 16*q,   16*q+4, 16*q+8,  16*q+12, \
+                    16*q+1, 16*q+5, 16*q+9,  16*q+13, \
+                    16*q+2, 16*q+6, 16*q+10, 16*q+14, \
+                    16*q+3, 16*q+7, 16*q+11, 16*q+15
+
+#define SS_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define SS_QR(a, b, c, d) do {                  \
+        b ^= SS_ROTL(a + d,  7);                \
+        c ^= SS_ROTL(b + a,  9);                \
+        d ^= SS_ROTL(c + b, 13);                \
+        a ^= SS_ROTL(d + c, 18);                \
+    } while (0)
+#define SS_ROUNDS(x, i) do {                            \
+        for (i = 20; i > 0; i -= 2)                     \
+        {                                               \
+            SS_QR(x[ 0], x[ 4], x[ 8], x[12]);          \
+            SS_QR(x[ 5], x[ 9], x[13], x[ 1]);          \
+            SS_QR(x[10], x[14], x[ 2], x[ 6]);          \
+            SS_QR(x[15], x[ 3], x[ 7], x[11]);          \
+            SS_QR(x[ 0], x[ 1], x[ 2], x[ 3]);          \
+            SS_QR(x[ 5], x[ 6], x[ 7], x[ 4]);          \
+            SS_QR(x[10], x[11], x[ 8], x[ 9]);          \
+            SS_QR(x[15], x[12], x[13], x[14]);          \
+        }                                               \
+    } while (0)
+
+/* Write SS_BLOCKS consecutive keystream blocks, starting at BLOCK, to
+   OBUF.  */
+SS_TARGET static void
+SS_FN(salsa20_blocks)(const uint32_t input[16], uint64_t block,
+                      uint8_t *obuf)
+{
+    static const ss_word lo32 = { SS_EACH_LANE(SS_LO32) };
+    static const ss_word hi32 = { SS_EACH_LANE(SS_HI32) };
+    static const ss_word lo64 = { SS_EACH_LANE(SS_LO64) };
+    static const ss_word hi64 = { SS_EACH_LANE(SS_HI64) };
+    const ss_word zero = { 0 };
+    ss_word s[16], x[16], lane;
+    int i, g, q;
+
+    for (i = 0; i < SS_BLOCKS; i++)
+        lane[i] = (uint32_t) i;
+    for (i = 0; i < 16; i++)
+        s[i] = zero + input[i];
+    s[8] = zero + (uint32_t) block;
+    s[9] = zero + (uint32_t) (block >> 32);
+    s[8] += lane;
+    s[9] -= (ss_word) (s[8] < lane);  /* carry */
+
+    for (i = 0; i < 16; i++)
+        x[i] = s[i];
+    SS_ROUNDS(x, i);
+    for (i = 0; i < 16; i++)
+        x[i] += s[i];
+
+    /* Words 4G..4G+3 of block 4Q+R end up in lane Q of T[R].  */
+    for (g = 0; g < 4; g++)
+    {
+        ss_word a = __builtin_shuffle(x[4*g+0], x[4*g+1], lo32);
+        ss_word b = __builtin_shuffle(x[4*g+0], x[4*g+1], hi32);
+        ss_word c = __builtin_shuffle(x[4*g+2], x[4*g+3], lo32);
+        ss_word d = __builtin_shuffle(x[4*g+2], x[4*g+3], hi32);
+        ss_word t[4] = {
+            __builtin_shuffle(a, c, lo64),
+            __builtin_shuffle(a, c, hi64),
+            __builtin_shuffle(b, d, lo64),
+            __builtin_shuffle(b, d, hi64),
+        };
+
+        for (q = 0; q < SS_BLOCKS / 4; q++)
+            for (i = 0; i < 4; i++)
+                memcpy(obuf + 64*(4*q + i) + 16*g,
+                       (const uint8_t *)&t[i] + 16*q, 16);
+    }
+}
+
+static void
+SS_FN(salsa20_ctr_blocks)(const salsa20_context *ctx, uint64_t block,
+                          size_t nblocks, uint8_t *obuf)
+{
+    for (; nblocks >= SS_BLOCKS;
+         nblocks -= SS_BLOCKS, block += SS_BLOCKS, obuf += 64 * SS_BLOCKS)
+        SS_FN(salsa20_blocks)(ctx->input, block, obuf);
+    salsa20_ctr_blocks_scalar(ctx, block, nblocks, obuf);
+}
+
+/* Regroup the bytes of V so that byte C of every lane, in lane order,
+   is row C: bytes C*SS_BLOCKS through C*SS_BLOCKS+SS_BLOCKS-1.  */
+SS_TARGET static inline ss_bytes
+SS_FN(ss_rows)(ss_word v)
+{
+#if SS_BLOCKS == 4
+    /* SSE2 has no byte shuffle, but two rounds of interleaving the
+       low and high halves do the same.  */
+    __m128i t = (__m128i) v;
+    t = _mm_unpacklo_epi8(t, _mm_srli_si128(t, 8));
+    t = _mm_unpacklo_epi8(t, _mm_srli_si128(t, 8));
+    return (ss_bytes) t;
+#else
+    /* Gather the rows within each 128-bit lane, then the 32-bit
+       pieces of each row across lanes.  */
+    static const ss_bytes bytes = { SS_EACH_LANE(SS_BYTES) };
+    static const ss_word rows = { SS_ROWS };
+    return (ss_bytes) __builtin_shuffle(
+        (ss_word) __builtin_shuffle((ss_bytes) v, bytes), rows);
+#endif
+}
+
+/* Write bytes OFFSET through OFFSET+OLEN-1 of the keystream of each
+   of the SS_BLOCKS contexts at CTX to OBUF, byte OFFSET+P of context
+   L going to OBUF[P*STRIDE + L].  */
+SS_TARGET static void
+SS_FN(salsa20_gen_lanes)(const salsa20_context *ctx, size_t offset,
+                         uint8_t *obuf, size_t olen, size_t stride)
+{
+    const ss_word zero = { 0 };
+    ss_word s[16], x[16];
+    ss_bytes t;
+    uint64_t block;
+    size_t pos;
+    int i, l, c;
+
+    for (i = 0; i < 16; i++)
+        for (l = 0; l < SS_BLOCKS; l++)
+            s[i][l] = ctx[l].input[i];
+
+    for (block = offset / 64; 64 * block < offset + olen; block++)
+    {
+        s[8] = zero + (uint32_t) block;
+        s[9] = zero + (uint32_t) (block >> 32);
+        for (i = 0; i < 16; i++)
+            x[i] = s[i];
+        SS_ROUNDS(x, i);
+
+        for (i = 0; i < 16; i++)
+        {
+            t = SS_FN(ss_rows)(x[i] + s[i]);
+            for (c = 0; c < 4; c++)
+            {
+                pos = 64 * block + 4 * i + c;
+                if (pos >= offset && pos < offset + olen)
+                    memcpy(obuf + (pos - offset) * stride,
+                           (const uint8_t *)&t + c * SS_BLOCKS, SS_BLOCKS);
+            }
+        }
+    }
+}
+
+#undef ss_word
+#undef ss_bytes
+
+#undef SS_EACH_LANE
+#undef SS_LO32
+#undef SS_HI32
+#undef SS_LO64
+#undef SS_HI64
+#undef SS_BYTES
+#undef SS_ROWS
+#undef SS_ROTL
+#undef SS_QR
+#undef SS_ROUNDS
+
+#undef SS_CAT_
+#undef SS_CAT
+#undef SS_FN
+
+#undef SS_ISA
+#undef SS_TARGET
+#undef SS_BLOCKS
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
@@ -5,7 +5,9 @@
  */
 
 #include "ciphers.h"
+#include "contexts.h"
 
+#include <immintrin.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -35,12 +37,31 @@
 #define PLUS(v,w) (U32V((v) + (w)))
 #define PLUSONE(v) (PLUS((v),1))
 
-typedef struct
+/*
+ * There are four implementations of counter mode: the scalar core
+ * function below, one block at a time, and SSE2, AVX2 and AVX-512
+ * kernels that compute 4, 8 or 16 consecutive blocks at once.  Each
+ * context records the one that was chosen when its key was set up;
+ * salsa20_default_backend picks the first one the CPU supports.
+ *
+ * Each backend can also generate the same stretch of keystream for
+ * LANES contexts at once, one context per lane, for
+ * gen_keystream_batch.  The worker asks each context for only a few
+ * blocks at a time, too few for ctr_blocks to fill a vector.
+ */
+typedef struct salsa20_backend
 {
-    uint32_t input[16];
-    size_t offset;
+    const char *name;
+    bool (*supported)(void);
+    void (*ctr_blocks)(const salsa20_context *ctx, uint64_t block,
+                       size_t nblocks, uint8_t *obuf);
+    size_t lanes;
+    void (*gen_lanes)(const salsa20_context *ctx, size_t offset,
+                      uint8_t *obuf, size_t olen, size_t stride);
 }
-salsa20_context;
+salsa20_backend;
+
+static const salsa20_backend *salsa20_default_backend(void);
 
 static void
 salsa20_128_init(void *ctx_, const uint8_t *k)
@@ -48,6 +69,8 @@ salsa20_128_init(void *ctx_, const uint8_t *k)
     static const char constants[] = "expand 16-byte k";
     salsa20_context *ctx = ctx_;
 
+    ctx->impl = salsa20_default_backend();
+
     ctx->input[ 1] = U8TO32_LITTLE(k + 0);
     ctx->input[ 2] = U8TO32_LITTLE(k + 4);
     ctx->input[ 3] = U8TO32_LITTLE(k + 8);
@@ -72,6 +95,8 @@ salsa20_256_init(void *ctx_, const uint8_t *k)
     static const char constants[] = "expand 32-byte k";
     salsa20_context *ctx = ctx_;
 
+    ctx->impl = salsa20_default_backend();
+
     ctx->input[ 1] = U8TO32_LITTLE(k + 0);
     ctx->input[ 2] = U8TO32_LITTLE(k + 4);
     ctx->input[ 3] = U8TO32_LITTLE(k + 8);
@@ -90,6 +115,17 @@ salsa20_256_init(void *ctx_, const uint8_t *k)
     ctx->input[ 9] = 0;
 }
 
+/* The nonce is words 6 and 7, which the reference implementation
+   loads from an 8-byte IV in little-endian order, so NONCE is that
+   IV read as a little-endian integer.  */
+static void
+salsa20_set_nonce(void *ctx_, uint64_t nonce)
+{
+    salsa20_context *ctx = ctx_;
+    ctx->input[6] = (uint32_t) nonce;
+    ctx->input[7] = (uint32_t) (nonce >> 32);
+}
+
 /* This is the Salsa20 "core function".  Despite Salsa20 being
    described by its author as a stream cipher, this function is maybe
    best thought of as a 512-bit block cipher, which gen_keystream()
@@ -186,44 +222,174 @@ salsa20_wordtobyte(uint8_t output[64], const uint32_t input[16])
     U32TO8_LITTLE(output + 60,x15);
 }
 
+/* Write NBLOCKS consecutive keystream blocks, starting at BLOCK, to
+   OBUF.  Input words 8 and 9 are a 64-bit little-endian block
+   counter.  */
 static void
-salsa20_gen_keystream(void *ctx_, size_t offset,
-                      uint8_t *obuf, size_t olen)
+salsa20_ctr_blocks_scalar(const salsa20_context *ctx, uint64_t block,
+                          size_t nblocks, uint8_t *obuf)
 {
-    salsa20_context *ctx = ctx_;
-    uint8_t block[64];
-    uint8_t *limit = obuf + olen;
-    size_t offset_512b, offset_rem, i;
+    uint32_t input[16];
 
-    if (olen == 0)
-        return;
+    memcpy(input, ctx->input, sizeof input);
+    for (; nblocks; nblocks--, block++, obuf += 64)
+    {
+        input[8] = (uint32_t) block;
+        input[9] = (uint32_t) (block >> 32);
+        salsa20_wordtobyte(obuf, input);
+    }
+}
+
+static void salsa20_gen_keystream(void *ctx, size_t offset,
+                                  uint8_t *obuf, size_t olen);
+
+/* gen_lanes for one context: generate its keystream a few blocks at
+   a time and store it with stride STRIDE.  */
+static void
+salsa20_gen_lanes_scalar(const salsa20_context *ctx, size_t offset,
+                         uint8_t *obuf, size_t olen, size_t stride)
+{
+    uint8_t block[256];
+    size_t i, chunk, done;
 
-    /* Initialize input[8] and [9] to a 64-bit little-endian count of
-       the number of 64-byte (512-bit) cipher blocks already consumed
-       at OFFSET. */
-    offset_512b = offset / 64;
-    offset_rem  = offset % 64;
-#if SIZE_MAX > 0xFFFFFFFF
-    ctx->input[9] = (uint32_t) ((offset_512b >> 32) & 0xFFFFFFFFu);
-#endif
-    ctx->input[8] = (uint32_t) ((offset_512b      ) & 0xFFFFFFFFu);
-
-    i = offset_rem;
-    for (;;)
+    for (done = 0; done < olen; done += chunk)
     {
-        salsa20_wordtobyte(block, ctx->input);
-        for (; i < 64; i++)
+        chunk = olen - done;
+        if (chunk > sizeof block)
+            chunk = sizeof block;
+        salsa20_gen_keystream((void *) ctx, offset + done, block, chunk);
+        for (i = 0; i < chunk; i++)
+            obuf[(done + i) * stride] = block[i];
+    }
+}
+
+/* AVX-512: sixteen blocks, one 512-bit register per state word.
+   AVX512BW is needed for a fast byte transpose in gen_lanes.  */
+#define SS_ISA    avx512
+#define SS_TARGET __attribute__((target("avx512f,avx512bw")))
+#define SS_BLOCKS 16
+#include "salsa20-simd.h"
+
+/* AVX2: eight blocks.  */
+#define SS_ISA    avx2
+#define SS_TARGET __attribute__((target("avx2")))
+#define SS_BLOCKS 8
+#include "salsa20-simd.h"
+
+/* SSE2: four blocks.  */
+#define SS_ISA    sse2
+#define SS_TARGET
+#define SS_BLOCKS 4
+#include "salsa20-simd.h"
+
+static bool
+avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw");
+}
+
+static bool
+avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool
+always_supported(void)
+{
+    return true;
+}
+
+static const salsa20_backend salsa20_backends[] = {
+    { "avx512", avx512_supported, salsa20_ctr_blocks_avx512,
+      16, salsa20_gen_lanes_avx512 },
+    { "avx2",   avx2_supported,   salsa20_ctr_blocks_avx2,
+      8,  salsa20_gen_lanes_avx2 },
+    { "sse2",   always_supported, salsa20_ctr_blocks_sse2,
+      4,  salsa20_gen_lanes_sse2 },
+    { "scalar", always_supported, salsa20_ctr_blocks_scalar,
+      1,  salsa20_gen_lanes_scalar },
+    { 0, 0, 0, 0, 0 }
+};
+
+static const char *const salsa20_impls[] = {
+    "avx512", "avx2", "sse2", "scalar", 0
+};
+
+/* Set by salsa20_use_impl; shared by salsa20_128 and salsa20_256.  */
+static const salsa20_backend *salsa20_forced_backend;
+
+static const salsa20_backend *
+salsa20_default_backend(void)
+{
+    const salsa20_backend *b;
+    if (salsa20_forced_backend)
+        return salsa20_forced_backend;
+    for (b = salsa20_backends; !b->supported(); b++)
+        ;
+    return b;
+}
+
+static bool
+salsa20_use_impl(const char *name)
+{
+    const salsa20_backend *b;
+
+    if (!name)
+    {
+        salsa20_forced_backend = 0;
+        return true;
+    }
+    for (b = salsa20_backends; b->name; b++)
+        if (!strcmp(b->name, name))
         {
-            *obuf++ = block[i];
-            if (obuf >= limit)
-                return;
+            if (!b->supported())
+                return false;
+            salsa20_forced_backend = b;
+            return true;
         }
+    return false;
+}
 
-        i = 0;
-        ctx->input[8]++;
-        if (!ctx->input[8])
-            ctx->input[9]++;
-    }
+static const char *
+salsa20_current_impl(void)
+{
+    return salsa20_default_backend()->name;
+}
+
+static void
+salsa20_gen_blocks(void *ctx_, uint64_t block, size_t nblocks,
+                   uint8_t *obuf)
+{
+    const salsa20_context *ctx = ctx_;
+    ctx->impl->ctr_blocks(ctx, block, nblocks, obuf);
+}
+
+static void
+salsa20_gen_keystream(void *ctx, size_t offset, uint8_t *obuf, size_t olen)
+{
+    cipher_ctr_gen_keystream(salsa20_gen_blocks, 64, ctx, offset, obuf, olen);
+}
+
+/* All the contexts in a batch were set up together, so they have the
+   same backend.  Contexts left over after filling as many groups of
+   its width as possible go to the narrower backends after it in the
+   table, all of which the CPU also supports; the last of them is one
+   context wide.  */
+static void
+salsa20_gen_keystream_batch(void *ctxs, size_t n, size_t offset,
+                            uint8_t *obuf, size_t olen)
+{
+    const salsa20_context *ctx = ctxs;
+    const salsa20_backend *b;
+    size_t k = 0;
+
+    if (n == 0)
+        return;
+    for (b = ctx->impl; b->name; b++)
+        for (; k + b->lanes <= n; k += b->lanes)
+            b->gen_lanes(ctx + k, offset, obuf + k, olen, n);
 }
 
 /* Salsa20 test vectors from http://www.ecrypt.eu.org/stream/svn/viewcvs.cgi/ecrypt/trunk/submissions/salsa20/full/verified.test-vectors?logsort=rev&rev=210&view=markup */
@@ -428,29 +594,45 @@ dump_hex(const char *label, const uint8_t *p, size_t n)
     putc('\n', stderr);
 }
 
+/* Each sample is checked twice: generated on its own, which goes
+   through the one-block path, and as part of one long run from offset
+   zero, which is long enough to go through every multi-block kernel.  */
 static void
-salsa20_test_one_size(void (*init)(void *, const uint8_t *),
+salsa20_test_one_size(const salsa20_backend *b,
+                      void (*init)(void *, const uint8_t *),
                       const uint8_t keys[4][32],
                       const struct keystream_expectation samples[4][4])
 {
     int i, j;
-    uint8_t ksbuf[64];
+    uint8_t ksbuf[64], run[1024];
+    const uint8_t *got;
     salsa20_context ctx;
     bool failed = false;
 
     for (i = 0; i < 4; i++)
     {
         init(&ctx, keys[i]);
+        ctx.impl = b;
+        salsa20_gen_keystream(&ctx, 0, run, sizeof run);
 
-        for (j = 0; j < 4; j++)
+        for (j = 0; j < 8; j++)
         {
-            salsa20_gen_keystream(&ctx, samples[i][j].offset, ksbuf, 64);
-            if (memcmp(ksbuf, samples[i][j].sample, 16))
+            const struct keystream_expectation *s = &samples[i][j/2];
+            if (j % 2)
+                got = run + s->offset;
+            else
+            {
+                salsa20_gen_keystream(&ctx, s->offset, ksbuf, 64);
+                got = ksbuf;
+            }
+            if (memcmp(got, s->sample, 64))
             {
-                fprintf(stderr, "FAIL: salsa20 keystream %d/%d (offset %d):\n",
-                        i+1, j+1, samples[i][j].offset);
-                dump_hex("  exp: ", samples[i][j].sample, 16);
-                dump_hex("  got: ", ksbuf, 16);
+                fprintf(stderr,
+                        "FAIL: salsa20 (%s) keystream %d/%d (offset %d%s):\n",
+                        b->name, i+1, j/2+1, s->offset,
+                        j % 2 ? ", long run" : "");
+                dump_hex("  exp: ", s->sample, 64);
+                dump_hex("  got: ", got, 64);
                 putc('\n', stderr);
                 failed = true;
             }
@@ -460,19 +642,128 @@ salsa20_test_one_size(void (*init)(void *, const uint8_t *),
         abort();
 }
 
+/* The sets above all use a zero IV.  This is vector 0 of set 6,
+   whose IV is 0D74DB42A91077DE.  */
+static const uint8_t
+salsa20_nonce_test_key[32] =
+    B32((00,53,A6,F9,4C,9F,F2,45,98,EB,3E,91,E4,37,8A,DD),
+        (30,83,D6,29,7C,CF,22,75,C8,1B,6E,C1,14,67,BA,0D));
+
+static const struct keystream_expectation
+salsa20_nonce_test_keystream =
+    {   0, B64((F5,FA,D5,3F,79,F9,DF,58,C4,AE,A0,D0,ED,9A,96,01),
+               (F2,78,11,2C,A7,18,0D,56,5B,42,0A,48,01,96,70,EA),
+               (F2,4C,E4,93,A8,62,63,F6,77,B4,6A,CE,19,24,77,3D),
+               (2B,B2,55,71,E1,AA,85,93,75,8F,C3,82,B1,28,0B,71)) };
+
+static void
+salsa20_test_nonce(const salsa20_backend *b)
+{
+    const struct keystream_expectation *s = &salsa20_nonce_test_keystream;
+    uint8_t ksbuf[64];
+    salsa20_context ctx;
+
+    salsa20_256_init(&ctx, salsa20_nonce_test_key);
+    salsa20_set_nonce(&ctx, 0xDE7710A942DB740Dull);
+    ctx.impl = b;
+    salsa20_gen_keystream(&ctx, s->offset, ksbuf, 64);
+    if (memcmp(ksbuf, s->sample, 64))
+    {
+        fprintf(stderr, "FAIL: salsa20 (%s) keystream with nonce:\n",
+                b->name);
+        dump_hex("  exp: ", s->sample, 64);
+        dump_hex("  got: ", ksbuf, 64);
+        putc('\n', stderr);
+        abort();
+    }
+}
+
+/* Check gen_keystream_batch against each context's own keystream,
+   for a batch that is not a multiple of any backend's width, at an
+   offset and lengths that are not multiples of the block size.  */
+#define SALSA20_TEST_BATCH 19
+#define SALSA20_TEST_LEN   700
+
+static void
+salsa20_test_batch(const salsa20_backend *b)
+{
+    salsa20_context ctxs[SALSA20_TEST_BATCH];
+    uint8_t key[32];
+    uint8_t *got, *exp;
+    size_t n, k, len;
+
+    got = malloc(SALSA20_TEST_BATCH * SALSA20_TEST_LEN);
+    exp = malloc(SALSA20_TEST_BATCH * SALSA20_TEST_LEN);
+    if (!got || !exp)
+        abort();
+
+    for (k = 0; k < SALSA20_TEST_BATCH; k++)
+    {
+        for (n = 0; n < sizeof key; n++)
+            key[n] = (uint8_t)(k * 32 + n);
+        salsa20_256_init(&ctxs[k], key);
+        ctxs[k].impl = b;
+        salsa20_gen_lanes_scalar(&ctxs[k], 37, exp + k, SALSA20_TEST_LEN,
+                                 SALSA20_TEST_BATCH);
+    }
+
+    for (n = 0; n < SALSA20_TEST_LEN; n += len)
+    {
+        len = n % 300 + 1;
+        if (len > SALSA20_TEST_LEN - n)
+            len = SALSA20_TEST_LEN - n;
+        salsa20_gen_keystream_batch(ctxs, SALSA20_TEST_BATCH, 37 + n,
+                                    got + n * SALSA20_TEST_BATCH, len);
+    }
+
+    for (n = 0; n < SALSA20_TEST_LEN * SALSA20_TEST_BATCH; n++)
+        if (got[n] != exp[n])
+        {
+            fprintf(stderr, "FAIL: salsa20 (%s) batch: context %zu "
+                    "offset %zu exp %02x got %02x\n", b->name,
+                    n % SALSA20_TEST_BATCH, 37 + n / SALSA20_TEST_BATCH,
+                    exp[n], got[n]);
+            abort();
+        }
+
+    free(got);
+    free(exp);
+}
+
+/* Test every backend this CPU can run, not just the default.  */
 static void
 salsa20_selftest(void)
 {
-    salsa20_test_one_size(salsa20_128_init,
-                          salsa20_128_test_keys,
-                          salsa20_128_test_keystreams);
-    salsa20_test_one_size(salsa20_256_init,
-                          salsa20_256_test_keys,
-                          salsa20_256_test_keystreams);
+    const salsa20_backend *b;
+
+    for (b = salsa20_backends; b->name; b++)
+    {
+        if (!b->supported())
+            continue;
+
+        salsa20_test_one_size(b, salsa20_128_init,
+                              salsa20_128_test_keys,
+                              salsa20_128_test_keystreams);
+        salsa20_test_one_size(b, salsa20_256_init,
+                              salsa20_256_test_keys,
+                              salsa20_256_test_keystreams);
+        salsa20_test_nonce(b);
+        salsa20_test_batch(b);
+    }
 }
 
-DEFINE_CIPHER(salsa20_128, salsa20, 16);
-DEFINE_CIPHER(salsa20_256, salsa20, 32);
+DEFINE_CIPHER(salsa20_128, salsa20, 16,
+              .impls = salsa20_impls, .use_impl = salsa20_use_impl,
+              .current_impl = salsa20_current_impl,
+              .blocksize = 64, .gen_blocks = salsa20_gen_blocks,
+              .gen_keystream_batch = salsa20_gen_keystream_batch,
+              .set_nonce = salsa20_set_nonce);
+DEFINE_CIPHER(salsa20_256, salsa20, 32,
+              .impls = salsa20_impls, .use_impl = salsa20_use_impl,
+              .current_impl = salsa20_current_impl,
+              .blocksize = 64, .gen_blocks = salsa20_gen_blocks,
+              .gen_keystream_batch = salsa20_gen_keystream_batch,
+              .set_nonce = salsa20_set_nonce);
 
 /*
  * Local Variables:
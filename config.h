@@ -20,9 +20,17 @@
 #ifndef CONFIG_H__
 #define CONFIG_H__
 
-/* We analyze the first KEYSTREAM_LENGTH bytes of keystream produced
-   by each key.  */
-#define KEYSTREAM_LENGTH 65536ul
+/* By default, we analyze the first DEFAULT_KEYSTREAM_LENGTH bytes of
+   keystream produced by each key.  The length can be chosen for each
+   run, but it must be a multiple of KEYSTREAM_GRANULE.  */
+#define DEFAULT_KEYSTREAM_LENGTH 65536ul
+#define KEYSTREAM_GRANULE 256ul
+
+/* Each worker accumulates its histogram in counters of this many bits
+   (8, 16, or 32), and adds them into the 32-bit totals in
+   work_results often enough that they cannot overflow.  Narrower
+   counters keep more of the histogram in cache.  */
+#define HISTOGRAM_COUNTER_BITS 8
 
 #endif /* config.h */
 
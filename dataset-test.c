@@ -22,16 +22,31 @@
 #include <stddef.h>
 #include <inttypes.h>
 
-int
-main(void)
+/* Write and read back a dataset of LENGTH rows, after extending it
+   to EXTEND_TO rows if that is larger.  */
+static void
+round_trip(uint64_t length, uint64_t extend_to)
 {
-    static dataset d1, d2;
+    dataset d1, d2;
     d1.cipher_index = 3;
     d1.highest_key = 4242424242;
+    d1.nonces = 17;
+    d1.key_suffix = 2;
+    d1.offset = (uint64_t)1 << 20;
+    dataset_alloc(&d1, length);
 
-    for (size_t i = 0; i < KEYSTREAM_LENGTH; i++)
+    for (size_t i = 0; i < length; i++)
         for (size_t j = 0; j < 256; j++)
             d1.epmf[i][j] = i*1000 + j;
+    if (extend_to > length)
+    {
+        dataset_extend(&d1, extend_to);
+        for (size_t j = 0; j < 256; j++)
+            d1.epmf[length][j] = j;
+        if (d1.nregions != 2 || d1.region_row[1] != length
+            || d1.region_key[1] != d1.highest_key)
+            errx(1, "extension did not add a region");
+    }
     dataset_write("test.hdf", &d1);
     dataset_read("test.hdf", &d2);
 
@@ -41,12 +56,60 @@ main(void)
     if (d1.highest_key != d2.highest_key)
         errx(1, "highest key mismatch: %"PRIu64"/%"PRIu64,
              d1.highest_key, d2.highest_key);
+    if (d1.nonces != d2.nonces)
+        errx(1, "nonce count mismatch: %"PRIu32"/%"PRIu32,
+             d1.nonces, d2.nonces);
+    if (d1.key_suffix != d2.key_suffix)
+        errx(1, "key suffix mismatch: %"PRIu32"/%"PRIu32,
+             d1.key_suffix, d2.key_suffix);
+    if (d1.offset != d2.offset)
+        errx(1, "offset mismatch: %"PRIu64"/%"PRIu64,
+             d1.offset, d2.offset);
+    if (d1.length != d2.length)
+        errx(1, "length mismatch: %"PRIu64"/%"PRIu64,
+             d1.length, d2.length);
+
+    if (d1.nregions != d2.nregions)
+        errx(1, "region count mismatch: %"PRIu32"/%"PRIu32,
+             d1.nregions, d2.nregions);
+    for (uint32_t r = 0; r < d1.nregions; r++)
+        if (d1.region_row[r] != d2.region_row[r]
+            || d1.region_key[r] != d2.region_key[r])
+            errx(1, "region %"PRIu32" mismatch: %"PRIu64",%"PRIu64
+                 "/%"PRIu64",%"PRIu64, r,
+                 d1.region_row[r], d1.region_key[r],
+                 d2.region_row[r], d2.region_key[r]);
 
-    for (size_t i = 0; i < KEYSTREAM_LENGTH; i++)
+    for (size_t i = 0; i < d1.length; i++)
         for (size_t j = 0; j < 256; j++)
             if (d1.epmf[i][j] != d2.epmf[i][j])
                 errx(1, "data mismatch at [%zu][%zu]: %"PRIu32"/%"PRIu32,
                      i, j, d1.epmf[i][j], d2.epmf[i][j]);
+
+    /* Filling in the new region merges it back into the old one.  */
+    if (d2.nregions > 1)
+    {
+        dataset_set_region_key(&d2, 1, 0);
+        if (d2.nregions != 1)
+            errx(1, "filled-in region was not merged");
+    }
+
+    dataset_free(&d1);
+    dataset_free(&d2);
+}
+
+int
+main(void)
+{
+    round_trip(DEFAULT_KEYSTREAM_LENGTH, 0);
+
+    /* Rewriting the file with a different length must resize the
+       HDF5 dataset, not just fail.  */
+    round_trip(KEYSTREAM_GRANULE, 0);
+
+    /* An extended dataset keeps its old rows and records where the
+       new ones begin.  */
+    round_trip(KEYSTREAM_GRANULE, 3 * KEYSTREAM_GRANULE);
     return 0;
 }
 
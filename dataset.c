@@ -22,6 +22,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -91,11 +92,96 @@ pop_auto_report(old_auto_report *state)
 /* HDF5 attribute corresponding to dataset.highest_key */
 #define HIGHEST_KEY_ATTR_NAME "nkeys"
 
+/* HDF5 attribute corresponding to dataset.nonces.  Files written
+   before nonce sweeps existed don't have it, and used one nonce per
+   key.  */
+#define NONCES_ATTR_NAME "nonces"
+
+/* HDF5 attribute corresponding to dataset.key_suffix; likewise
+   optional, and 0 if absent.  */
+#define KEY_SUFFIX_ATTR_NAME "key_suffix"
+
+/* HDF5 attribute corresponding to dataset.offset; likewise optional,
+   and 0 if absent.  */
+#define OFFSET_ATTR_NAME "offset"
+
+/* HDF5 attribute corresponding to dataset.region_row and
+   dataset.region_key, as one row of two numbers per region.  Files
+   that have never been extended don't have it, and are one region
+   starting at key 0.  */
+#define REGIONS_ATTR_NAME "regions"
+
+void
+dataset_alloc(dataset *data, uint64_t length)
+{
+    data->length = length;
+    data->epmf = page_alloc(length * sizeof *data->epmf, &data->pages);
+    data->nregions = 1;
+    data->region_row[0] = 0;
+    data->region_key[0] = 0;
+}
+
+void
+dataset_free(dataset *data)
+{
+    page_free(data->epmf, data->length * sizeof *data->epmf, data->pages);
+    data->length = 0;
+    data->epmf = 0;
+}
+
+void
+dataset_extend(dataset *data, uint64_t length)
+{
+    uint32_t (*epmf)[256];
+    page_kind pages;
+    uint32_t r = data->nregions;
+
+    if (length <= data->length)
+        abort();
+    if (r == DATASET_MAX_REGIONS)
+        errx(1, "dataset already has %d regions; fill some in first",
+             DATASET_MAX_REGIONS);
+
+    epmf = page_alloc(length * sizeof *epmf, &pages);
+    memcpy(epmf, data->epmf, data->length * sizeof *epmf);
+    page_free(data->epmf, data->length * sizeof *data->epmf, data->pages);
+
+    data->region_row[r] = data->length;
+    data->nregions = r + 1;
+    data->length = length;
+    data->epmf = epmf;
+    data->pages = pages;
+    dataset_set_region_key(data, r, data->highest_key);
+}
+
+/* Merge region R into region R-1.  */
+static void
+remove_region(dataset *data, uint32_t r)
+{
+    data->nregions--;
+    memmove(&data->region_row[r], &data->region_row[r + 1],
+            (data->nregions - r) * sizeof *data->region_row);
+    memmove(&data->region_key[r], &data->region_key[r + 1],
+            (data->nregions - r) * sizeof *data->region_key);
+}
+
+void
+dataset_set_region_key(dataset *data, uint32_t r, uint64_t key)
+{
+    data->region_key[r] = key;
+    if (r + 1 < data->nregions && data->region_key[r + 1] == key)
+        remove_region(data, r + 1);
+    if (r > 0 && data->region_key[r - 1] == key)
+        remove_region(data, r);
+}
+
 bool
 dataset_read(const char *fname, dataset *data)
 {
-    hid_t file, dset, dspace, kattr, cattr, catype;
-    hsize_t dims[2];
+    hid_t file, dset, dspace, kattr, nattr, sattr, oattr, rattr, rspace;
+    hid_t cattr, catype;
+    hsize_t dims[2], rdims[2];
+    uint64_t regions[DATASET_MAX_REGIONS][2];
     char cname[24];
     int rank, i;
     old_auto_report astate;
@@ -118,16 +204,81 @@ dataset_read(const char *fname, dataset *data)
         errx(1, "%s/%s: has %d dimensions, expected 2",
              fname, EPMF_DSET_NAME, rank);
     H5Sget_simple_extent_dims(dspace, dims, 0);
-    if (dims[0] != KEYSTREAM_LENGTH || dims[1] != 256)
-        errx(1, "%s/%s: dimensions are [%llu][%llu], expected [%lu][%u]",
-             fname, EPMF_DSET_NAME, dims[0], dims[1], KEYSTREAM_LENGTH, 256);
+    if (dims[0] == 0 || dims[0] % KEYSTREAM_GRANULE || dims[1] != 256)
+        errx(1, "%s/%s: dimensions are [%llu][%llu], expected [%lu*N][%u]",
+             fname, EPMF_DSET_NAME, dims[0], dims[1], KEYSTREAM_GRANULE, 256);
 
+    dataset_alloc(data, dims[0]);
     H5Dread(dset, H5T_NATIVE_UINT32, H5S_ALL, dspace, H5P_DEFAULT,
             data->epmf);
 
     kattr = H5Aopen(dset, HIGHEST_KEY_ATTR_NAME, H5P_DEFAULT);
     H5Aread(kattr, H5T_NATIVE_UINT64, &data->highest_key);
 
+    data->nonces = 1;
+    if (H5Aexists(dset, NONCES_ATTR_NAME))
+    {
+        nattr = H5Aopen(dset, NONCES_ATTR_NAME, H5P_DEFAULT);
+        H5Aread(nattr, H5T_NATIVE_UINT32, &data->nonces);
+        H5Aclose(nattr);
+        if (data->nonces == 0)
+            errx(1, "%s/%s/%s: must be positive",
+                 fname, EPMF_DSET_NAME, NONCES_ATTR_NAME);
+    }
+
+    data->key_suffix = 0;
+    if (H5Aexists(dset, KEY_SUFFIX_ATTR_NAME))
+    {
+        sattr = H5Aopen(dset, KEY_SUFFIX_ATTR_NAME, H5P_DEFAULT);
+        H5Aread(sattr, H5T_NATIVE_UINT32, &data->key_suffix);
+        H5Aclose(sattr);
+    }
+
+    data->offset = 0;
+    if (H5Aexists(dset, OFFSET_ATTR_NAME))
+    {
+        oattr = H5Aopen(dset, OFFSET_ATTR_NAME, H5P_DEFAULT);
+        H5Aread(oattr, H5T_NATIVE_UINT64, &data->offset);
+        H5Aclose(oattr);
+    }
+
+    if (H5Aexists(dset, REGIONS_ATTR_NAME))
+    {
+        rattr = H5Aopen(dset, REGIONS_ATTR_NAME, H5P_DEFAULT);
+        rspace = H5Aget_space(rattr);
+        if (H5Sget_simple_extent_ndims(rspace) != 2)
+            errx(1, "%s/%s/%s: expected 2 dimensions",
+                 fname, EPMF_DSET_NAME, REGIONS_ATTR_NAME);
+        H5Sget_simple_extent_dims(rspace, rdims, 0);
+        if (rdims[0] == 0 || rdims[0] > DATASET_MAX_REGIONS
+            || rdims[1] != 2)
+            errx(1, "%s/%s/%s: dimensions are [%llu][%llu],"
+                 " expected [1..%d][2]", fname, EPMF_DSET_NAME,
+                 REGIONS_ATTR_NAME, rdims[0], rdims[1],
+                 DATASET_MAX_REGIONS);
+        H5Aread(rattr, H5T_NATIVE_UINT64, regions);
+        H5Sclose(rspace);
+        H5Aclose(rattr);
+
+        data->nregions = (uint32_t) rdims[0];
+        for (i = 0; i < (int) data->nregions; i++)
+        {
+            if (regions[i][0] >= data->length
+                || (i == 0 && regions[i][0] != 0)
+                || (i > 0 && regions[i][0] <= regions[i-1][0]))
+                errx(1, "%s/%s/%s: region %d starts at row %"PRIu64,
+                     fname, EPMF_DSET_NAME, REGIONS_ATTR_NAME,
+                     i, regions[i][0]);
+            if (regions[i][1] > data->highest_key)
+                errx(1, "%s/%s/%s: region %d starts at key %"PRIu64
+                     ", past %"PRIu64, fname, EPMF_DSET_NAME,
+                     REGIONS_ATTR_NAME, i, regions[i][1],
+                     data->highest_key);
+            data->region_row[i] = regions[i][0];
+            data->region_key[i] = regions[i][1];
+        }
+    }
+
     cattr = H5Aopen(dset, CIPHER_INDEX_ATTR_NAME, H5P_DEFAULT);
     catype = H5Aget_type(cattr);
     if (H5Tget_size(catype) > sizeof cname)
@@ -201,6 +352,41 @@ ensure_attr(hid_t loc, const char *attr_name, hid_t type, hid_t space)
                      H5P_DEFAULT, H5P_DEFAULT);
 }
 
+/* True if a dataset whose dataspace is A can be given the current
+   dimensions of B with H5Dset_extent: same rank, and each dimension
+   of B within the corresponding maximum dimension of A.  */
+static bool
+space_fits(hid_t a, hid_t b)
+{
+    if (!H5Sis_simple(a) || !H5Sis_simple(b))
+        abort();
+    if (H5Sget_simple_extent_type(a) != H5Sget_simple_extent_type(b))
+        return false;
+    if (H5Sget_simple_extent_type(a) != H5S_SIMPLE)
+        return true;
+
+    int rank = H5Sget_simple_extent_ndims(a);
+    if (rank != H5Sget_simple_extent_ndims(b))
+        return false;
+
+    hsize_t adim[rank], bdim[rank], amaxdim[rank];
+    H5Sget_simple_extent_dims(a, adim, amaxdim);
+    H5Sget_simple_extent_dims(b, bdim, 0);
+
+    for (int i = 0; i < rank; i++)
+        if (bdim[i] > amaxdim[i])
+            return false;
+    return true;
+}
+
+/* Open the dataset DSET_NAME, resized to the current dimensions of
+   SPACE, or create it if it doesn't exist or can't be made to match.
+   Datasets created here with unlimited maximum dimensions are
+   resized in place, so extending a data set to a longer keystream
+   does not leave the old data behind as dead space in the file.
+   Files written before that have fixed dimensions; extending one
+   recreates the dataset once, and h5repack will reclaim the space
+   the old copy occupied.  */
 static hid_t
 ensure_dset(hid_t loc_id, const char *dset_name,
             hid_t type, hid_t space, hid_t cpl)
@@ -211,14 +397,20 @@ ensure_dset(hid_t loc_id, const char *dset_name,
         hid_t file_space = H5Dget_space(dset);
         hid_t file_type = H5Dget_type(dset);
         hid_t file_cpl = H5Dget_create_plist(dset);
-        bool ok = (spaces_equal(file_space, space) &&
+        bool ok = (space_fits(file_space, space) &&
                    H5Tequal(file_type, type) &&
                    H5Pequal(file_cpl, cpl));
         H5Sclose(file_space);
         H5Tclose(file_type);
         H5Pclose(file_cpl);
         if (ok)
+        {
+            int rank = H5Sget_simple_extent_ndims(space);
+            hsize_t dims[rank];
+            H5Sget_simple_extent_dims(space, dims, 0);
+            H5Dset_extent(dset, dims);
             return dset;
+        }
         H5Dclose(dset);
         H5Ldelete(loc_id, dset_name, H5P_DEFAULT);
     }
@@ -229,8 +421,10 @@ ensure_dset(hid_t loc_id, const char *dset_name,
 void
 dataset_write(const char *fname, const dataset *data)
 {
-    hid_t file, dset, dspace, dcpl, aspace, kattr, cattr, catype;
-    hsize_t dims[2], chunk[2];
+    hid_t file, dset, dspace, dcpl, aspace, rspace;
+    hid_t kattr, nattr, sattr, oattr, rattr, cattr, catype;
+    hsize_t dims[2], maxdims[2], chunk[2], rdims[2];
+    uint64_t regions[DATASET_MAX_REGIONS][2];
     size_t cnamelen;
     old_auto_report astate;
 
@@ -238,11 +432,13 @@ dataset_write(const char *fname, const dataset *data)
     file = H5Fopen(fname, H5F_ACC_RDWR|H5F_ACC_CREAT, H5P_DEFAULT);
 
     /* data */
-    dims[0] = KEYSTREAM_LENGTH;
+    dims[0] = data->length;
     dims[1] = 256;
+    maxdims[0] = H5S_UNLIMITED;
+    maxdims[1] = 256;
     chunk[0] = 256;
     chunk[1] = 256;
-    dspace = H5Screate_simple(2, dims, 0);
+    dspace = H5Screate_simple(2, dims, maxdims);
     dcpl = H5Pcreate(H5P_DATASET_CREATE);
     H5Pset_deflate(dcpl, 9);
     H5Pset_chunk(dcpl, 2, chunk);
@@ -262,6 +458,31 @@ dataset_write(const char *fname, const dataset *data)
     H5Awrite(kattr, H5T_NATIVE_UINT64, &data->highest_key);
     H5Aclose(kattr);
 
+    nattr = ensure_attr(dset, NONCES_ATTR_NAME, H5T_STD_U32LE, aspace);
+    H5Awrite(nattr, H5T_NATIVE_UINT32, &data->nonces);
+    H5Aclose(nattr);
+
+    sattr = ensure_attr(dset, KEY_SUFFIX_ATTR_NAME, H5T_STD_U32LE, aspace);
+    H5Awrite(sattr, H5T_NATIVE_UINT32, &data->key_suffix);
+    H5Aclose(sattr);
+
+    oattr = ensure_attr(dset, OFFSET_ATTR_NAME, H5T_STD_U64LE, aspace);
+    H5Awrite(oattr, H5T_NATIVE_UINT64, &data->offset);
+    H5Aclose(oattr);
+
+    for (uint32_t r = 0; r < data->nregions; r++)
+    {
+        regions[r][0] = data->region_row[r];
+        regions[r][1] = data->region_key[r];
+    }
+    rdims[0] = data->nregions;
+    rdims[1] = 2;
+    rspace = H5Screate_simple(2, rdims, 0);
+    rattr = ensure_attr(dset, REGIONS_ATTR_NAME, H5T_STD_U64LE, rspace);
+    H5Awrite(rattr, H5T_NATIVE_UINT64, regions);
+    H5Aclose(rattr);
+    H5Sclose(rspace);
+
     cnamelen = strlen(all_ciphers[data->cipher_index]->name);
     catype = H5Tcopy(H5T_C_S1);
     H5Tset_size(catype, cnamelen + 1);
@@ -21,23 +21,71 @@
 #define DATASET_H__
 
 #include "config.h"
+#include "pagealloc.h"
 
 #include <stdint.h>
 #include <stdbool.h>
 
+/* A dataset can be extended to a longer keystream this many times,
+   less one, before the extensions have to be filled in.  */
+#define DATASET_MAX_REGIONS 16
+
 typedef struct
 {
     uint32_t cipher_index;
     uint64_t highest_key;
 
-    uint32_t epmf[KEYSTREAM_LENGTH][256];
+    /* Every key was run with this many nonces (see work_order), so
+       the histogram holds HIGHEST_KEY * NONCES samples.  */
+    uint32_t nonces;
+
+    /* The keys came in families sharing all but their last KEY_SUFFIX
+       bytes (see work_order), or were independent if this is 0.  */
+    uint32_t key_suffix;
+
+    /* EPMF has one row for each of the LENGTH bytes of keystream
+       beginning at byte OFFSET.  */
+    uint64_t offset;
+    uint64_t length;
+    uint32_t (*epmf)[256];
+    page_kind pages;
+
+    /* The rows are divided into NREGIONS regions.  Region R is rows
+       REGION_ROW[R] up to the start of the next region, and holds
+       samples from keys REGION_KEY[R] through HIGHEST_KEY-1 only.  A
+       new dataset is one region, starting at key 0; extending it to
+       a longer keystream adds a region for the new rows, starting at
+       the current HIGHEST_KEY, until someone goes back and runs the
+       earlier keys over those rows too.  */
+    uint32_t nregions;
+    uint64_t region_row[DATASET_MAX_REGIONS];
+    uint64_t region_key[DATASET_MAX_REGIONS];
 }
 dataset;
 
-/* Read a data set from file FNAME into DATA.  On success, returns
-   true.  If FNAME does not exist or is empty, returns false and does
-   not modify DATA.  On any other error condition, terminates the
-   program. */
+/* Allocate a zeroed histogram in DATA for keystream length LENGTH,
+   as a single region starting at key 0, or free it.  Allocation
+   failure terminates the program.  */
+extern void dataset_alloc(dataset *data, uint64_t length);
+extern void dataset_free(dataset *data);
+
+/* Lengthen the histogram in DATA to LENGTH rows, keeping the
+   existing rows and adding a region of zeroed rows after them, with
+   no keys yet.  Allocation failure, or running out of regions,
+   terminates the program.  */
+extern void dataset_extend(dataset *data, uint64_t length);
+
+/* Record that region R now holds samples from keys KEY onward, and
+   merge it with any neighbour that then covers the same keys, which
+   renumbers the regions after it.  */
+extern void dataset_set_region_key(dataset *data, uint32_t r,
+                                   uint64_t key);
+
+/* Read a data set from file FNAME into DATA, allocating its
+   histogram with the length recorded in the file.  On success,
+   returns true.  If FNAME does not exist or is empty, returns false
+   and does not modify DATA.  On any other error condition, terminates
+   the program. */
 extern bool dataset_read(const char *fname, dataset *data);
 
 /* Write a data set to a file named FNAME.  Succeeds or else
@@ -0,0 +1,169 @@
+/*
+ *  RNGstats allocator for large histograms.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include "pagealloc.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define SIZE_2M (((size_t)1) << 21)
+#define SIZE_1G (((size_t)1) << 30)
+
+bool page_alloc_use_huge = true;
+
+static size_t
+round_up(size_t size, size_t unit)
+{
+    return (size + unit - 1) & ~(unit - 1);
+}
+
+/* The length of the mapping page_alloc made for SIZE bytes of KIND. */
+static size_t
+mapped_size(size_t size, page_kind kind)
+{
+    switch (kind)
+    {
+    case PAGES_HUGE_1G:
+        return round_up(size, SIZE_1G);
+    case PAGES_HUGE_2M:
+        return round_up(size, SIZE_2M);
+    case PAGES_NORMAL:
+    case PAGES_TRANSPARENT:
+        break;
+    }
+    return round_up(size, (size_t)sysconf(_SC_PAGESIZE));
+}
+
+/* True unless the kernel has transparent huge pages switched off
+   altogether, in which case madvise still succeeds but does nothing.
+   Even when this is true, the kernel may not find any huge pages to
+   give us, so a successful madvise is only ever a request.  The
+   setting is read once, the first time it is needed.  */
+static bool thp_enabled;
+
+static void
+read_thp_setting(void)
+{
+    char buf[128];
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+    if (!f)
+        return;
+    thp_enabled = !(fgets(buf, sizeof buf, f) && strstr(buf, "[never]"));
+    fclose(f);
+}
+
+static bool
+thp_possible(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, read_thp_setting);
+    return thp_enabled;
+}
+
+static void *
+try_map(size_t size, int flags)
+{
+    void *p = mmap(0, size, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|flags, -1, 0);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+void *
+page_alloc(size_t size, page_kind *kind)
+{
+    void *p;
+
+    /* Only ask for huge pages when the allocation fills at least one,
+       since hugetlbfs pages come from a limited reserved pool.  */
+    if (page_alloc_use_huge)
+    {
+        if (size >= SIZE_1G &&
+            (p = try_map(mapped_size(size, PAGES_HUGE_1G),
+                         MAP_HUGETLB|MAP_HUGE_1GB)))
+        {
+            *kind = PAGES_HUGE_1G;
+            return p;
+        }
+        if (size >= SIZE_2M &&
+            (p = try_map(mapped_size(size, PAGES_HUGE_2M),
+                         MAP_HUGETLB|MAP_HUGE_2MB)))
+        {
+            *kind = PAGES_HUGE_2M;
+            return p;
+        }
+    }
+
+    p = try_map(mapped_size(size, PAGES_NORMAL), 0);
+    if (!p)
+        err(1, "allocating %zu bytes", size);
+
+    *kind = PAGES_NORMAL;
+#ifdef MADV_HUGEPAGE
+    if (page_alloc_use_huge && size >= SIZE_2M && thp_possible() &&
+        !madvise(p, mapped_size(size, PAGES_NORMAL), MADV_HUGEPAGE))
+        *kind = PAGES_TRANSPARENT;
+#endif
+    return p;
+}
+
+void
+page_free(void *p, size_t size, page_kind kind)
+{
+    if (p)
+        munmap(p, mapped_size(size, kind));
+}
+
+const char *
+page_kind_name(page_kind kind)
+{
+    switch (kind)
+    {
+    case PAGES_NORMAL:      return "normal pages";
+    case PAGES_TRANSPARENT: return "transparent huge pages requested";
+    case PAGES_HUGE_2M:     return "2 MiB huge pages";
+    case PAGES_HUGE_1G:     return "1 GiB huge pages";
+    }
+    return "?";
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
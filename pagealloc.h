@@ -0,0 +1,63 @@
+/*
+ *  RNGstats allocator for large histograms.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef PAGEALLOC_H__
+#define PAGEALLOC_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The histograms are tens of megabytes and are accessed one row at
+   a time, all over the place, so with ordinary pages we take a dTLB
+   miss on nearly every access.  This allocator backs them with the
+   largest pages it can get.  */
+typedef enum
+{
+    PAGES_NORMAL,       /* ordinary pages */
+    PAGES_TRANSPARENT,  /* ordinary mapping, transparent huge pages
+                           requested with madvise; the kernel may
+                           still back it with ordinary pages */
+    PAGES_HUGE_2M,      /* hugetlbfs, 2 MiB pages */
+    PAGES_HUGE_1G       /* hugetlbfs, 1 GiB pages */
+}
+page_kind;
+
+/* If false, page_alloc uses only ordinary pages.  Defaults to true. */
+extern bool page_alloc_use_huge;
+
+/* Allocate SIZE bytes of zeroed memory, and report in *KIND what sort
+   of pages back it.  Failure terminates the program.  */
+extern void *page_alloc(size_t size, page_kind *kind);
+
+/* Release memory obtained from page_alloc.  SIZE and KIND must be as
+   for the allocation.  */
+extern void page_free(void *p, size_t size, page_kind kind);
+
+/* Human-readable description of KIND.  */
+extern const char *page_kind_name(page_kind kind);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
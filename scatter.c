@@ -0,0 +1,249 @@
+/*
+ *  RNGstats: histogram scatter kernels.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include "scatter.h"
+
+#include <immintrin.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Within one row, several keys can hit the same counter, so the
+   increments for one row form a chain of dependent read-modify-write
+   operations.  Different rows never share a counter, though, so every
+   kernel works on several rows at once to overlap those chains.  */
+
+static bool
+always_supported(void)
+{
+    return true;
+}
+
+static void
+scatter_scalar(hist_counter (*counts)[256], const uint8_t *block,
+               size_t nrows, size_t nkeys)
+{
+    size_t k, n;
+    const uint8_t *b;
+
+    for (k = 0; k < nrows; k += 4)
+    {
+        b = block + k * nkeys;
+        for (n = 0; n < nkeys; n++)
+        {
+            counts[k  ][b[n]]           += 1;
+            counts[k+1][b[nkeys + n]]   += 1;
+            counts[k+2][b[2*nkeys + n]] += 1;
+            counts[k+3][b[3*nkeys + n]] += 1;
+        }
+    }
+}
+
+/* The vector kernels treat COUNTS as an array of 32-bit words, each
+   holding COUNTERS_PER_WORD counters.  Counter C of the block is in
+   word C >> WORD_SHIFT, and incrementing it means adding
+   1 << ((C & WORD_MASK) * HISTOGRAM_COUNTER_BITS) to that word; that
+   can't carry into the next counter, since none ever exceeds
+   COUNTER_KEYS.  */
+#define COUNTERS_PER_WORD (32 / HISTOGRAM_COUNTER_BITS)
+#define WORD_SHIFT        (COUNTERS_PER_WORD == 4 ? 2 : \
+                           COUNTERS_PER_WORD == 2 ? 1 : 0)
+#define WORD_MASK         (COUNTERS_PER_WORD - 1)
+
+/* AVX2 can gather eight keystream bytes, one from each of eight rows,
+   and compute all eight counter addresses at once, but it has no
+   scatter, so the increments themselves are done one at a time.  */
+static bool
+avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void
+scatter_avx2(hist_counter (*counts)[256], const uint8_t *block,
+             size_t nrows, size_t nkeys)
+{
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const __m256i stride = _mm256_mullo_epi32(lanes,
+                                              _mm256_set1_epi32(nkeys));
+    const __m256i row_base = _mm256_slli_epi32(lanes, 8);
+    uint32_t idx[8] __attribute__((aligned(32)));
+    hist_counter *c;
+    const uint8_t *b;
+    __m256i v;
+    size_t k, n;
+
+    for (k = 0; k < nrows; k += 8)
+    {
+        b = block + k * nkeys;
+        c = counts[k];
+        for (n = 0; n < nkeys; n++)
+        {
+            v = _mm256_i32gather_epi32((const int *)(b + n), stride, 1);
+            v = _mm256_add_epi32(row_base, _mm256_and_si256(v, byte_mask));
+            _mm256_store_si256((__m256i *)idx, v);
+            c[idx[0]] += 1;
+            c[idx[1]] += 1;
+            c[idx[2]] += 1;
+            c[idx[3]] += 1;
+            c[idx[4]] += 1;
+            c[idx[5]] += 1;
+            c[idx[6]] += 1;
+            c[idx[7]] += 1;
+        }
+    }
+}
+
+/* AVX-512 does the whole thing sixteen rows at a time: gather the
+   keystream bytes, gather the words holding their counters, add, and
+   scatter the words back.  The sixteen words are in sixteen different
+   rows, so the scatter never has conflicting lanes.  */
+static bool
+avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+__attribute__((target("avx512f")))
+static void
+scatter_avx512(hist_counter (*counts)[256], const uint8_t *block,
+               size_t nrows, size_t nkeys)
+{
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                            8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i byte_mask = _mm512_set1_epi32(0xff);
+    const __m512i word_mask = _mm512_set1_epi32(WORD_MASK);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i stride = _mm512_mullo_epi32(lanes,
+                                              _mm512_set1_epi32(nkeys));
+    const __m512i row_base = _mm512_slli_epi32(lanes, 8);
+    __m512i idx, word, shift, v;
+    const uint8_t *b;
+    int *c;
+    size_t k, n;
+
+    for (k = 0; k < nrows; k += 16)
+    {
+        b = block + k * nkeys;
+        c = (int *)counts[k];
+        for (n = 0; n < nkeys; n++)
+        {
+            idx = _mm512_i32gather_epi32(stride, b + n, 1);
+            idx = _mm512_add_epi32(row_base, _mm512_and_si512(idx, byte_mask));
+            word = _mm512_srli_epi32(idx, WORD_SHIFT);
+            shift = _mm512_mullo_epi32(_mm512_and_si512(idx, word_mask),
+                                       _mm512_set1_epi32(HISTOGRAM_COUNTER_BITS));
+            v = _mm512_i32gather_epi32(word, c, 4);
+            v = _mm512_add_epi32(v, _mm512_sllv_epi32(one, shift));
+            _mm512_i32scatter_epi32(c, word, v, 4);
+        }
+    }
+}
+
+const scatter_kernel scatter_kernels[] = {
+    { "scalar", always_supported, scatter_scalar },
+    { "avx2",   avx2_supported,   scatter_avx2   },
+    { "avx512", avx512_supported, scatter_avx512 },
+    { 0, 0, 0 }
+};
+
+const scatter_kernel *scatter_current;
+
+/* Which kernel is fastest depends on the microarchitecture, not just
+   the instruction set: gather and scatter are microcoded on some
+   chips, and a loss there.  So we simply try them all.  */
+#define CAL_ROWS  256
+#define CAL_KEYS   32
+#define CAL_REPS   64
+#define CAL_TRIALS  3
+
+static double
+now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void
+calibrate(void)
+{
+    static hist_counter counts[CAL_ROWS][256];
+    static uint8_t block[CAL_ROWS * CAL_KEYS + SCATTER_PAD];
+    const scatter_kernel *k, *best = &scatter_kernels[0];
+    double t, best_t = -1;
+    uint32_t x = 1;
+    size_t i;
+    int trial, rep;
+
+    if (scatter_current)
+        return;
+
+    for (i = 0; i < sizeof block; i++)
+    {
+        x = x * 1103515245u + 12345u;
+        block[i] = x >> 24;
+    }
+
+    for (k = scatter_kernels; k->name; k++)
+    {
+        if (!k->supported())
+            continue;
+        for (trial = 0; trial < CAL_TRIALS; trial++)
+        {
+            t = now();
+            for (rep = 0; rep < CAL_REPS; rep++)
+            {
+                /* Keep the counters from overflowing, as spilling
+                   would.  */
+                if (rep % (COUNTER_KEYS / CAL_KEYS) == 0)
+                    memset(counts, 0, sizeof counts);
+                k->fn(counts, block, CAL_ROWS, CAL_KEYS);
+            }
+            t = now() - t;
+            if (best_t < 0 || t < best_t)
+            {
+                best_t = t;
+                best = k;
+            }
+        }
+    }
+    scatter_current = best;
+}
+
+const scatter_kernel *
+scatter_select(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, calibrate);
+    return scatter_current;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
@@ -0,0 +1,84 @@
+/*
+ *  RNGstats: histogram scatter kernels.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SCATTER_H__
+#define SCATTER_H__
+
+#include "config.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Every key adds exactly one to each row of the histogram, so a
+   counter of HISTOGRAM_COUNTER_BITS bits can absorb COUNTER_KEYS
+   keys before it has to be spilled into the totals.  */
+#if HISTOGRAM_COUNTER_BITS == 8
+typedef uint8_t hist_counter;
+#elif HISTOGRAM_COUNTER_BITS == 16
+typedef uint16_t hist_counter;
+#elif HISTOGRAM_COUNTER_BITS == 32
+typedef uint32_t hist_counter;
+#else
+#error "HISTOGRAM_COUNTER_BITS must be 8, 16, or 32"
+#endif
+
+#define COUNTER_KEYS ((uint64_t)(hist_counter)-1)
+
+/* A scatter kernel adds one block of position-major keystream to the
+   histogram: for each of NROWS rows k and NKEYS keys n, it increments
+   COUNTS[k][BLOCK[k*NKEYS + n]].  NROWS must be a multiple of
+   SCATTER_ROWS.  The vector kernels read whole words of BLOCK, so it
+   must be followed by SCATTER_PAD bytes of addressable memory.  They
+   also update counters a 32-bit word at a time, which is exact only
+   because no counter is ever allowed to exceed COUNTER_KEYS.  */
+#define SCATTER_ROWS 16
+#define SCATTER_PAD   4
+
+typedef void (*scatter_fn)(hist_counter (*counts)[256],
+                           const uint8_t *block,
+                           size_t nrows, size_t nkeys);
+
+typedef struct
+{
+    const char *name;
+    bool (*supported)(void);
+    scatter_fn fn;
+}
+scatter_kernel;
+
+/* All the kernels, terminated by a null entry.  The first one is the
+   portable fallback and is always supported.  */
+extern const scatter_kernel scatter_kernels[];
+
+/* The kernel the workers use.  If it is null when scatter_select is
+   first called, scatter_select times each kernel the CPU supports on
+   a synthetic block and installs the fastest; set it beforehand to
+   force a particular kernel.  */
+extern const scatter_kernel *scatter_current;
+extern const scatter_kernel *scatter_select(void);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
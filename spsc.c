@@ -0,0 +1,66 @@
+/*
+ *  RNGstats: lock-free single-producer, single-consumer ring.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include "spsc.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+
+void
+spsc_init(spsc_ring *r, size_t nslots, size_t slotsize)
+{
+    void *slots;
+    int rv;
+
+    /* Round slots up to a whole number of cache lines, so the
+       producer writing one slot never disturbs the consumer reading
+       the previous one.  */
+    slotsize = (slotsize + 63) & ~(size_t)63;
+    rv = posix_memalign(&slots, 64, nslots * slotsize);
+    if (rv)
+    {
+        errno = rv;
+        err(1, "allocating %zu-slot ring", nslots);
+    }
+
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->nslots = nslots;
+    r->slotsize = slotsize;
+    r->slots = slots;
+}
+
+void
+spsc_free(spsc_ring *r)
+{
+    free(r->slots);
+    r->slots = 0;
+    r->nslots = 0;
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
@@ -0,0 +1,97 @@
+/*
+ *  RNGstats: lock-free single-producer, single-consumer ring.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SPSC_H__
+#define SPSC_H__
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A ring of NSLOTS fixed-size slots, shared by exactly one producer
+   thread and one consumer thread.  Slots are filled and drained in
+   place: the producer claims the next free slot, writes into it, and
+   publishes it; the consumer peeks at the oldest published slot,
+   reads it, and releases it.  HEAD and TAIL count slots ever
+   published and released, respectively, and each is written by only
+   one side, so no locks or read-modify-write operations are needed.
+   They live on separate cache lines so the two sides don't fight
+   over one.  */
+typedef struct
+{
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) size_t nslots;
+    size_t slotsize;
+    uint8_t *slots;
+} spsc_ring;
+
+/* Allocate (or free) the slots of R.  Allocation failure terminates
+   the program.  */
+extern void spsc_init(spsc_ring *r, size_t nslots, size_t slotsize);
+extern void spsc_free(spsc_ring *r);
+
+/* Producer side.  spsc_claim waits for a free slot and returns it;
+   spsc_publish hands it to the consumer.  */
+static inline void *
+spsc_claim(spsc_ring *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+           == r->nslots)
+        sched_yield();
+    return r->slots + (head % r->nslots) * r->slotsize;
+}
+
+static inline void
+spsc_publish(spsc_ring *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/* Consumer side.  spsc_peek returns the oldest published slot, or
+   null if there isn't one; spsc_release hands it back to the
+   producer.  */
+static inline void *
+spsc_peek(spsc_ring *r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+        return 0;
+    return r->slots + (tail % r->nslots) * r->slotsize;
+}
+
+static inline void
+spsc_release(spsc_ring *r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
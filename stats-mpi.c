@@ -22,8 +22,12 @@
 #include "ciphers.h"
 #include "worker.h"
 #include "dataset.h"
+#include "topology.h"
+#include "scatter.h"
 
 #include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +39,13 @@
 
 static MPI_Datatype dt_work_order;
 
+/* When ranks are bound to CPUs, results are reduced first among the
+   ranks on each NUMA node (NUMA_COMM), and then among one rank from
+   each node (LEADER_COMM), so that only one histogram per node
+   crosses the interconnect.  Otherwise both are MPI_COMM_NULL.  */
+static MPI_Comm numa_comm = MPI_COMM_NULL;
+static MPI_Comm leader_comm = MPI_COMM_NULL;
+
 static volatile sig_atomic_t interrupted;
 
 static void
@@ -58,6 +69,72 @@ xmalloc(size_t sz)
     return rv;
 }
 
+/* Bind this rank to a CPU, choosing among the CPUs of this host by
+   its rank among the ranks on this host, and set up NUMA_COMM and
+   LEADER_COMM.  Collective over MPI_COMM_WORLD.  */
+static void
+bind_rank(int rank)
+{
+    MPI_Comm host_comm;
+    int host_rank, host_size, numa_rank;
+    unsigned int slot;
+    topology topo;
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                        MPI_INFO_NULL, &host_comm);
+    MPI_Comm_rank(host_comm, &host_rank);
+    MPI_Comm_size(host_comm, &host_size);
+
+    topology_read(&topo);
+    slot = topology_place(&topo, host_rank, host_size);
+    bind_to_cpu(topo.cpu[slot]);
+    fprintf(stderr, "rank %d: cpu %d, node %u\n",
+            rank, topo.cpu[slot], topo.node[slot]);
+
+    /* Keying on the world rank makes the head process, which is
+       host rank 0 and therefore on the first node, the root of both
+       stages of the reduction.  */
+    MPI_Comm_split(host_comm, (int)topo.node[slot], rank, &numa_comm);
+    MPI_Comm_rank(numa_comm, &numa_rank);
+    MPI_Comm_split(MPI_COMM_WORLD, numa_rank == 0 ? 0 : MPI_UNDEFINED,
+                   rank, &leader_comm);
+
+    MPI_Comm_free(&host_comm);
+    topology_free(&topo);
+}
+
+/* Sum the results in WR from all ranks into the head process's WR. */
+static void
+reduce_results(work_results *wr, MPI_Comm comm)
+{
+    int rank;
+
+    if (comm == MPI_COMM_NULL)
+        return;
+
+    MPI_Comm_rank(comm, &rank);
+    if (rank == 0)
+        MPI_Reduce(MPI_IN_PLACE, wr->epmf,
+                   (int)(wr->length * 256), MPI_UINT32_T, MPI_SUM,
+                   0, comm);
+    else
+        MPI_Reduce(wr->epmf, 0,
+                   (int)(wr->length * 256), MPI_UINT32_T, MPI_SUM,
+                   0, comm);
+}
+
+static void
+reduce_all_results(work_results *wr)
+{
+    if (numa_comm == MPI_COMM_NULL)
+        reduce_results(wr, MPI_COMM_WORLD);
+    else
+    {
+        reduce_results(wr, numa_comm);
+        reduce_results(wr, leader_comm);
+    }
+}
+
 static inline double
 timedelta_ns(const struct timespec *end,
              const struct timespec *start)
@@ -81,6 +158,47 @@ interval(clockid_t clk, struct timespec *start)
     return delta;
 }
 
+/* Give rank I keys BASE+I*STEP up to BASE+(I+1)*STEP, but not past
+   LIMIT, over the rows of DATA from FIRST_ROW on that WR has room
+   for, and add everyone's results into those rows.  */
+static void
+run_pass(int numprocs, work_order *wo, work_results *wr, dataset *data,
+         uint64_t base, uint64_t limit, uint64_t step, uint64_t first_row)
+{
+    work_order mywo;
+
+    /* Reinitialize work orders on each pass in case MPI_Scatter
+       clobbers them. */
+    for (int i = 0; i < numprocs; i++)
+    {
+        wo[i].base  = base + i*step;
+        if (wo[i].base > limit)
+            wo[i].base = limit;
+
+        wo[i].limit = base + (i+1)*step;
+        if (wo[i].limit > limit)
+            wo[i].limit = limit;
+
+        wo[i].offset = data->offset + first_row;
+        wo[i].length = wr->length;
+        wo[i].nonces = data->nonces;
+        wo[i].key_suffix = data->key_suffix;
+        wo[i].cipher_index = data->cipher_index;
+    }
+
+    MPI_Scatter(wo, 1, dt_work_order,
+                &mywo, 1, dt_work_order,
+                0, MPI_COMM_WORLD);
+
+    worker_run(&mywo, wr);
+
+    reduce_all_results(wr);
+
+    for (size_t i = 0; i < wr->length; i++)
+        for (size_t j = 0; j < 256; j++)
+            data->epmf[first_row + i][j] += wr->epmf[i][j];
+}
+
 static void
 head_process(int numprocs, const char *dataset_name,
              uint64_t count, uint64_t checkpoint_interval,
@@ -93,16 +211,20 @@ head_process(int numprocs, const char *dataset_name,
        can at least do an in-place receive to save having a _third_
        buffer on this process.  */
     work_order   *wo = xmalloc(sizeof(work_order) * numprocs);
-    work_results *wr  = xmalloc(sizeof(work_results));
+    work_results wr;
     work_order mywo;
-    uint64_t base, step, stride, sofar, since_last_checkpoint;
+    uint64_t base, step, max_step, stride, sofar, since_last_checkpoint;
+    uint64_t key, lo, row, end;
+    uint32_t r;
     struct timespec wall;
     double dwall;
 
+    /* Each rank gets up to 64K samples per pass.  */
+    max_step = (UINT16_MAX+1) / data->nonces;
     step = count / numprocs;
-    if (step > UINT16_MAX+1)
+    if (step > max_step)
     {
-        step = UINT16_MAX+1;
+        step = max_step;
         stride = step * numprocs;
     }
     else
@@ -110,40 +232,68 @@ head_process(int numprocs, const char *dataset_name,
     base = data->highest_key;
     sofar = 0;
     since_last_checkpoint = 0;
+    work_results_alloc(&wr, data->length);
+    fprintf(stderr, "dataset: %s; worker histograms: %s\n",
+            page_kind_name(data->pages), page_kind_name(wr.pages));
+    fprintf(stderr, "rank 0: scatter: %s; cipher: %s/%s\n",
+            scatter_select()->name, all_ciphers[data->cipher_index]->name,
+            cipher_impl_name(all_ciphers[data->cipher_index]));
 
     clock_gettime(CLOCK_MONOTONIC, &wall);
     signal(SIGUSR1, interrupt);
 
-    while (sofar < count && !interrupted)
+    if (!all_ciphers[data->cipher_index]->gen_blocks)
+        for (r = 1; r < data->nregions; r++)
+            fprintf(stderr, "rows %"PRIu64" on: samples from key %"PRIu64
+                    " on only\n", data->region_row[r], data->region_key[r]);
+
+    /* Fill in the rows added by extending the dataset, if the cipher
+       can seek (see stats-serial.c), one pass at a time from the
+       highest missing key down, so that every checkpoint records how
+       far each region has got.  */
+    while (all_ciphers[data->cipher_index]->gen_blocks && !interrupted)
     {
-        /* Reinitialize work orders on each pass in case MPI_Scatter
-           clobbers them. */
-        for (int i = 0; i < numprocs; i++)
+        for (r = data->nregions; r > 0 && !data->region_key[r-1]; r--)
+            ;
+        if (r-- == 0)
+            break;
+        row = data->region_row[r];
+        end = r + 1 < data->nregions ? data->region_row[r+1] : data->length;
+        if (wr.length != end - row)
         {
-            wo[i].base  = base + sofar + i*step;
-            if (wo[i].base > base + count)
-                wo[i].base = base + count;
-
-            wo[i].limit = base + sofar + (i+1)*step;
-            if (wo[i].limit > base + count)
-                wo[i].limit = base + count;
-
-            wo[i].cipher_index = data->cipher_index;
+            work_results_free(&wr);
+            work_results_alloc(&wr, end - row);
         }
 
-        MPI_Scatter(wo, 1, dt_work_order,
-                    &mywo, 1, dt_work_order,
-                    0, MPI_COMM_WORLD);
+        key = data->region_key[r];
+        lo = key > max_step * numprocs ? key - max_step * numprocs : 0;
+        run_pass(numprocs, wo, &wr, data, lo, key, max_step, row);
+        dataset_set_region_key(data, r, lo);
 
-        worker_run(&mywo, wr);
+        dwall = interval(CLOCK_MONOTONIC, &wall);
+        fprintf(stderr, "rows %"PRIu64"--%"PRIu64", %"PRIu64"--%"PRIu64
+                ": %9.5fs\n", row, end - 1, lo, key - 1, dwall);
 
-        MPI_Reduce(MPI_IN_PLACE, wr->epmf,
-                   KEYSTREAM_LENGTH * 256, MPI_UINT32_T, MPI_SUM,
-                   0, MPI_COMM_WORLD);
+        since_last_checkpoint += key - lo;
+        if (since_last_checkpoint > checkpoint_interval)
+        {
+            dataset_write(dataset_name, data);
+
+            since_last_checkpoint = 0;
+            dwall = interval(CLOCK_MONOTONIC, &wall);
+            fprintf(stderr, "checkpoint: %9.5fs\n", dwall);
+        }
+    }
+    if (wr.length != data->length)
+    {
+        work_results_free(&wr);
+        work_results_alloc(&wr, data->length);
+    }
 
-        for (size_t i = 0; i < KEYSTREAM_LENGTH; i++)
-            for (size_t j = 0; j < 256; j++)
-                data->epmf[i][j] += wr->epmf[i][j];
+    while (sofar < count && !interrupted)
+    {
+        run_pass(numprocs, wo, &wr, data, base + sofar, base + count,
+                 step, 0);
 
         dwall = interval(CLOCK_MONOTONIC, &wall);
         fprintf(stderr, "%"PRIu64"--%"PRIu64": %9.5fs\n",
@@ -179,6 +329,10 @@ head_process(int numprocs, const char *dataset_name,
     {
         wo[i].base = 0;
         wo[i].limit = 0;
+        wo[i].offset = 0;
+        wo[i].length = 0;
+        wo[i].nonces = 1;
+        wo[i].key_suffix = 0;
         wo[i].cipher_index = data->cipher_index;
     }
     MPI_Scatter(wo, 1, dt_work_order,
@@ -186,14 +340,14 @@ head_process(int numprocs, const char *dataset_name,
                 0, MPI_COMM_WORLD);
 
     free(wo);
-    free(wr);
+    work_results_free(&wr);
 }
 
 static void
-worker_process(void)
+worker_process(int rank)
 {
     work_order   *wo = xmalloc(sizeof(work_order));
-    work_results *wr = xmalloc(sizeof(work_results));
+    work_results wr = { 0, 0, PAGES_NORMAL };
 
     signal(SIGUSR1, SIG_IGN);
 
@@ -205,29 +359,42 @@ worker_process(void)
         if (wo->base == 0 && wo->limit == 0)
             break;
 
+        if (wo->length != wr.length)
+        {
+            work_results_free(&wr);
+            work_results_alloc(&wr, wo->length);
+            fprintf(stderr, "rank %d: worker histogram: %s; scatter: %s;"
+                    " cipher: %s/%s\n",
+                    rank, page_kind_name(wr.pages), scatter_select()->name,
+                    all_ciphers[wo->cipher_index]->name,
+                    cipher_impl_name(all_ciphers[wo->cipher_index]));
+        }
+
         /* The head process may not have any work for us this round,
            but we still have to participate in the reduce. */
         if (wo->base < wo->limit)
-            worker_run(wo, wr);
+            worker_run(wo, &wr);
         else
-            memset(wr, 0, sizeof(work_results));
+            memset(wr.epmf, 0, wr.length * sizeof *wr.epmf);
 
-        MPI_Reduce(wr->epmf, 0,
-                   KEYSTREAM_LENGTH * 256, MPI_UINT32_T, MPI_SUM,
-                   0, MPI_COMM_WORLD);
+        reduce_all_results(&wr);
     }
 
     free(wo);
-    free(wr);
+    work_results_free(&wr);
 }
 
 int
 main(int argc, char **argv)
 {
     char *endp, *dataset_name;
-    uint64_t count, checkpoint_interval;
+    const char *impl_spec;
+    uint64_t count, checkpoint_interval, offset, length;
     uint32_t cipher_index;
-    int nprocs, rank;
+    unsigned long nonces, key_suffix;
+    int nprocs, rank, opt;
+    bool bad_usage, bad_length, bad_nonces, bad_suffix, bad_offset, bind;
+    bool have_offset, extend;
 
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
@@ -238,50 +405,147 @@ main(int argc, char **argv)
     MPI_Type_contiguous(sizeof(work_order), MPI_BYTE, &dt_work_order);
     MPI_Type_commit(&dt_work_order);
 
+    /* Every process needs to see -b, -H and -i, but only the head
+       process complains about bad arguments.  */
+    opterr = (rank == 0);
+    offset = 0;
+    length = 0;
+    nonces = 0;
+    key_suffix = 0;
+    bad_usage = bad_length = bad_nonces = bad_suffix = bad_offset = false;
+    bind = have_offset = extend = false;
+    impl_spec = getenv(CIPHER_IMPL_ENV);
+    while ((opt = getopt(argc, argv, "bf:Hi:l:n:o:x")) != -1)
+        switch (opt)
+        {
+        case 'b':
+            bind = true;
+            break;
+
+        case 'f':
+            key_suffix = strtoul(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || key_suffix == 0
+                || key_suffix > MAX_KEY_SUFFIX)
+                bad_suffix = true;
+            break;
+
+        case 'H':
+            page_alloc_use_huge = false;
+            break;
+
+        case 'i':
+            impl_spec = optarg;
+            break;
+
+        case 'l':
+            length = strtoumax(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || length == 0
+                || length % KEYSTREAM_GRANULE)
+                bad_length = true;
+            break;
+
+        case 'n':
+            nonces = strtoul(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || nonces == 0
+                || nonces > UINT16_MAX + 1)
+                bad_nonces = true;
+            break;
+
+        case 'o':
+            offset = strtoumax(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0')
+                bad_offset = true;
+            have_offset = true;
+            break;
+
+        case 'x':
+            extend = true;
+            break;
+
+        default:
+            bad_usage = true;
+            break;
+        }
+
+    if (bind && !bad_usage && !bad_length && !bad_nonces && !bad_suffix
+        && !bad_offset)
+        bind_rank(rank);
+
+    /* Each rank picks its own implementations, since the nodes need
+       not all have the same CPU.  A forced implementation that some
+       node can't run is fatal for the whole job.  */
+    if (impl_spec && !cipher_use_impls(impl_spec))
+    {
+        fprintf(stderr, "rank %d: bad implementation spec '%s'\n",
+                rank, impl_spec);
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+
     if (rank == 0)
     {
-        if (argc < 3 || argc > 4)
+        if (bad_length)
         {
-            fprintf(stderr,
-                    "usage: %s cipher key-count [checkpoint-interval]\n",
-                    argv[0]);
-            goto list_ciphers;
+            fprintf(stderr, "keystream length is not a positive"
+                    " multiple of %lu\n", KEYSTREAM_GRANULE);
+            goto quit;
+        }
+        if (bad_nonces)
+        {
+            fprintf(stderr, "nonce count is not an integer in [1, %u]\n",
+                    UINT16_MAX + 1);
+            goto quit;
         }
+        if (bad_suffix)
+        {
+            fprintf(stderr, "key suffix is not an integer in [1, %d]\n",
+                    MAX_KEY_SUFFIX);
+            goto quit;
+        }
+        if (bad_offset)
+        {
+            fprintf(stderr, "keystream offset is not a nonnegative"
+                    " integer\n");
+            goto quit;
+        }
+        if (bad_usage || argc - optind < 2 || argc - optind > 3)
+            goto usage;
 
         for (cipher_index = 0; all_ciphers[cipher_index]; cipher_index++)
-            if (!strcmp(all_ciphers[cipher_index]->name, argv[1]))
+            if (!strcmp(all_ciphers[cipher_index]->name, argv[optind]))
                 break;
         if (!all_ciphers[cipher_index])
         {
             fprintf(stderr, "%s: unrecognized cipher: %s\n",
-                    argv[0], argv[1]);
+                    argv[0], argv[optind]);
             goto list_ciphers;
         }
 
-        count = strtoumax(argv[2], &endp, 10);
-        if (endp == argv[2] || *endp != '\0')
+        count = strtoumax(argv[optind+1], &endp, 10);
+        if (endp == argv[optind+1] || *endp != '\0')
         {
             fprintf(stderr, "key count '%s' is not a nonnegative integer",
-                    argv[2]);
+                    argv[optind+1]);
             goto quit;
         }
 
-        /* Default checkpoint interval is after 10 cycles of 64K keys. */
-        checkpoint_interval = nprocs * 10 * 65536;
-        if (argc == 4)
+        /* Default checkpoint interval is after 10 passes of 64K
+           samples per rank, which depends on the dataset's nonce
+           count; it is filled in below.  */
+        checkpoint_interval = 0;
+        if (argc - optind == 3)
         {
-            checkpoint_interval = strtoumax(argv[3], &endp, 10);
-            if (endp == argv[3] || *endp != '\0' || checkpoint_interval == 0)
+            checkpoint_interval = strtoumax(argv[optind+2], &endp, 10);
+            if (endp == argv[optind+2] || *endp != '\0' || checkpoint_interval == 0)
             {
                 fprintf(stderr,
                         "checkpoint interval '%s' is not a positive integer",
-                        argv[3]);
+                        argv[optind+2]);
                 goto quit;
             }
         }
 
         dataset_name = 0;
-        if (asprintf(&dataset_name, "results/%s.hdf", argv[1]) < 0)
+        if (asprintf(&dataset_name, "results/%s.hdf", argv[optind]) < 0)
         {
             perror("forming dataset name");
             goto quit;
@@ -298,28 +562,88 @@ main(int argc, char **argv)
                         all_ciphers[data->cipher_index]->name);
                 goto quit;
             }
+            if (have_offset && offset != data->offset)
+            {
+                fprintf(stderr, "dataset %s: keystream offset is %"PRIu64
+                        ", not %"PRIu64"\n",
+                        dataset_name, data->offset, offset);
+                goto quit;
+            }
+            if (length && length > data->length && extend)
+                dataset_extend(data, length);
+            else if (length && length != data->length)
+            {
+                fprintf(stderr, "dataset %s: keystream length is %"PRIu64
+                        ", not %"PRIu64"\n",
+                        dataset_name, data->length, length);
+                goto quit;
+            }
+            if (nonces && nonces != data->nonces)
+            {
+                fprintf(stderr, "dataset %s: nonce count is %"PRIu32
+                        ", not %lu\n", dataset_name, data->nonces, nonces);
+                goto quit;
+            }
+            if (key_suffix && key_suffix != data->key_suffix)
+            {
+                fprintf(stderr, "dataset %s: key suffix is %"PRIu32
+                        ", not %lu\n", dataset_name, data->key_suffix,
+                        key_suffix);
+                goto quit;
+            }
         }
         else
         {
+            dataset_alloc(data, length ? length : DEFAULT_KEYSTREAM_LENGTH);
             data->highest_key = 0;
             data->cipher_index = cipher_index;
+            data->nonces = nonces ? nonces : 1;
+            data->key_suffix = key_suffix;
+            data->offset = offset;
+        }
+        if (data->nonces > 1 && !all_ciphers[cipher_index]->set_nonce)
+        {
+            fprintf(stderr, "cipher %s does not take a nonce\n",
+                    argv[optind]);
+            goto quit;
+        }
+        if (!checkpoint_interval)
+            checkpoint_interval =
+                nprocs * 10 * (uint64_t)((UINT16_MAX + 1) / data->nonces);
+
+        /* MPI_Reduce takes an int count.  */
+        if (data->length > INT_MAX / 256)
+        {
+            fprintf(stderr, "keystream length %"PRIu64" is too long"
+                    " (max %d)\n", data->length, INT_MAX / 256);
+            goto quit;
         }
 
         /* If the cipher behavior is ideal, the 32-bit counters in the
-           file on disk will overflow at 2^40 keys.  Since we are
-           looking for non-ideal behavior, leave plenty of headroom. */
-        uint64_t limit = (((uint64_t)1) << 40) - 0xFFFFFFFF;
-        if (count == 0 || count + data->highest_key > limit)
+           file on disk will overflow at 2^40 samples.  Since we are
+           looking for non-ideal behavior, leave plenty of headroom.
+           A count of 0 runs up to that limit, except with -x, where it
+           means only to fill in the rows the extension added, as in
+           stats-serial.  */
+        uint64_t limit = ((((uint64_t)1) << 40) - 0xFFFFFFFF) / data->nonces;
+        if ((count == 0 && !extend) || count + data->highest_key > limit)
             count = limit - data->highest_key;
 
         head_process(nprocs, dataset_name, count, checkpoint_interval, data);
     }
     else
-        worker_process();
+        worker_process(rank);
 
     MPI_Finalize();
     return 0;
 
+ usage:
+    fprintf(stderr,
+            "usage: %s [-bH] [-f key-suffix] [-i impls] [-l length]"
+            " [-n nonces]\n"
+            "       [-o offset] [-x] cipher key-count"
+            " [checkpoint-interval]\n",
+            argv[0]);
  list_ciphers:
     fputs("supported ciphers:", stderr);
     for (int i = 0; all_ciphers[i]; i++)
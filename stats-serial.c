@@ -22,20 +22,220 @@
 #include "ciphers.h"
 #include "worker.h"
 #include "dataset.h"
+#include "topology.h"
+#include "scatter.h"
 
 #include <err.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+/* In threaded mode, each thread runs its own worker over a slice of
+   the key range, into a private work_results object.  The threads
+   then each sum one slice of the rows of all the private histograms
+   into the dataset.
+
+   When threads are bound to CPUs, the threads on each NUMA node are
+   consecutive, and the first of them is the node's leader.  Each
+   thread's histogram is first touched by worker_run, on its own
+   node.  The reduction first sums each node's histograms into its
+   leader's, using only that node's threads, and then sums the
+   leaders' histograms into the dataset, so only one histogram per
+   node crosses the interconnect.  Unbound, every thread is its own
+   leader.
+
+   In pipelined mode (-p), each thread runs its worker as a pipeline
+   of GEN_THREADS generator and ACC_THREADS accumulator threads, which
+   it starts itself.  Binding then restricts each thread to its node
+   rather than to one CPU, and the pipeline's threads inherit that.  */
+static topology topo;
+static unsigned int gen_threads, acc_threads;
+
+typedef struct worker_thread
+{
+    pthread_t thread;
+    work_order wo;
+    work_results wr;
+
+    int cpu;                    /* -1 if not bound */
+    unsigned int node;
+
+    dataset *data;
+    struct worker_thread *all;
+    unsigned int nthreads;
+    size_t first_row;           /* dataset row of histogram row 0 */
+    size_t row_lo;              /* slice of histogram rows */
+    size_t row_hi;
+
+    unsigned int leader;        /* index of this node's leader */
+    unsigned int node_threads;  /* number of threads on this node */
+    size_t node_row_lo;         /* slice of the leader's rows */
+    size_t node_row_hi;
+}
+worker_thread;
+
+static void
+bind_thread(const worker_thread *t)
+{
+    if (t->cpu < 0)
+        return;
+    if (gen_threads)
+        bind_to_node(&topo, t->node);
+    else
+        bind_to_cpu(t->cpu);
+}
+
+static void *
+run_worker(void *arg)
+{
+    worker_thread *t = arg;
+    bind_thread(t);
+    if (t->wo.base < t->wo.limit && gen_threads)
+        worker_run_pipelined(&t->wo, &t->wr, gen_threads, acc_threads);
+    else if (t->wo.base < t->wo.limit)
+        worker_run(&t->wo, &t->wr);
+    else
+        memset(t->wr.epmf, 0, t->wr.length * sizeof *t->wr.epmf);
+    return 0;
+}
+
+static void *
+reduce_node(void *arg)
+{
+    worker_thread *t = arg;
+    const struct worker_thread *all = t->all;
+    uint32_t (*dest)[256] = all[t->leader].wr.epmf;
+    size_t i, j;
+    unsigned int n;
+
+    bind_thread(t);
+    for (i = t->node_row_lo; i < t->node_row_hi; i++)
+        for (n = t->leader + 1; n < t->leader + t->node_threads; n++)
+            for (j = 0; j < 256; j++)
+                dest[i][j] += all[n].wr.epmf[i][j];
+    return 0;
+}
+
+static void *
+update_dataset(void *arg)
+{
+    worker_thread *t = arg;
+    const struct worker_thread *all = t->all;
+    uint32_t (*dest)[256] = t->data->epmf + t->first_row;
+    size_t i, j;
+    unsigned int n;
+
+    bind_thread(t);
+    for (i = t->row_lo; i < t->row_hi; i++)
+        for (n = 0; n < t->nthreads; n += all[n].node_threads)
+            for (j = 0; j < 256; j++)
+                dest[i][j] += all[n].wr.epmf[i][j];
+    return 0;
+}
+
+/* Assign each thread a CPU, if BIND, and work out which threads lead
+   each node.  */
+static void
+place_threads(worker_thread *threads, unsigned int nthreads, bool bind)
+{
+    unsigned int n, m, slot;
+
+    if (bind)
+        topology_read(&topo);
+
+    for (n = 0; n < nthreads; n++)
+    {
+        threads[n].cpu = -1;
+        threads[n].node = n;
+        if (bind)
+        {
+            slot = topology_place(&topo, n, nthreads);
+            threads[n].cpu = topo.cpu[slot];
+            threads[n].node = topo.node[slot];
+            if (gen_threads)
+                fprintf(stderr, "thread %u: node %u\n", n, threads[n].node);
+            else
+                fprintf(stderr, "thread %u: cpu %d, node %u\n",
+                        n, threads[n].cpu, threads[n].node);
+        }
+    }
+
+    for (n = 0; n < nthreads; n = m)
+    {
+        for (m = n; m < nthreads && threads[m].node == threads[n].node; m++)
+            ;
+        for (slot = n; slot < m; slot++)
+        {
+            threads[slot].leader = n;
+            threads[slot].node_threads = m - n;
+        }
+    }
+}
+
+/* Give every thread histograms of LENGTH rows, standing for dataset
+   rows FIRST_ROW onward, and divide the rows among the threads for
+   the reduction.  */
+static void
+slice_rows(worker_thread *threads, unsigned int nthreads,
+           uint64_t first_row, uint64_t length)
+{
+    unsigned int n, slot, k;
+
+    for (n = 0; n < nthreads; n++)
+    {
+        if (threads[n].wr.length != length)
+        {
+            work_results_free(&threads[n].wr);
+            work_results_alloc(&threads[n].wr, length);
+        }
+        threads[n].first_row = first_row;
+        threads[n].row_lo = length * n / nthreads;
+        threads[n].row_hi = length * (n+1) / nthreads;
+
+        slot = n - threads[n].leader;
+        k = threads[n].node_threads;
+        threads[n].node_row_lo = length * slot / k;
+        threads[n].node_row_hi = length * (slot + 1) / k;
+    }
+}
 
 static void
-update_dataset(dataset *data, work_results *wr)
+run_threads(worker_thread *threads, unsigned int nthreads,
+            void *(*fn)(void *))
 {
-    uint64_t i, j;
-    for (i = 0; i < KEYSTREAM_LENGTH; i++)
-        for (j = 0; j < 256; j++)
-            data->epmf[i][j] += wr->epmf[i][j];
+    unsigned int n;
+    int rv;
+
+    if (nthreads == 1)
+    {
+        fn(&threads[0]);
+        return;
+    }
+
+    for (n = 0; n < nthreads; n++)
+    {
+        rv = pthread_create(&threads[n].thread, 0, fn, &threads[n]);
+        if (rv)
+        {
+            errno = rv;
+            err(1, "pthread_create");
+        }
+    }
+    for (n = 0; n < nthreads; n++)
+    {
+        rv = pthread_join(threads[n].thread, 0);
+        if (rv)
+        {
+            errno = rv;
+            err(1, "pthread_join");
+        }
+    }
 }
 
 static inline double
@@ -61,40 +261,171 @@ interval(clockid_t clk, struct timespec *start)
     return delta;
 }
 
+/* Run keys BASE through LIMIT-1 over LENGTH rows of DATA starting at
+   FIRST_ROW, and add the results into those rows.  Each thread gets
+   up to 64K samples per pass.  */
+static void
+run_keys(worker_thread *threads, unsigned int nthreads, dataset *data,
+         uint64_t base, uint64_t limit, uint64_t first_row, uint64_t length,
+         bool bind, struct timespec *wall)
+{
+    uint64_t step;
+    unsigned int n;
+
+    slice_rows(threads, nthreads, first_row, length);
+    while (base < limit)
+    {
+        step = (UINT16_MAX + 1) * (uint64_t)nthreads / data->nonces;
+        if (step > limit - base)
+            step = limit - base;
+
+        for (n = 0; n < nthreads; n++)
+        {
+            threads[n].wo.cipher_index = data->cipher_index;
+            threads[n].wo.offset = data->offset + first_row;
+            threads[n].wo.length = length;
+            threads[n].wo.nonces = data->nonces;
+            threads[n].wo.key_suffix = data->key_suffix;
+            threads[n].wo.base  = base + step * n / nthreads;
+            threads[n].wo.limit = base + step * (n+1) / nthreads;
+        }
+
+        run_threads(threads, nthreads, run_worker);
+        if (bind)
+            run_threads(threads, nthreads, reduce_node);
+        run_threads(threads, nthreads, update_dataset);
+
+        fprintf(stderr, "%"PRIu64"--%"PRIu64": %9.5fs\n",
+                base, base+step-1, interval(CLOCK_MONOTONIC, wall));
+        base += step;
+    }
+}
+
 int
 main(int argc, char **argv)
 {
     static dataset data;
-    static work_order wo;
-    static work_results wr;
+    worker_thread *threads;
 
     char *endp, *dataset_name;
-    uint64_t base, count, limit;
-    uint32_t cipher_index;
+    const char *cipher_name, *impl_spec;
+    uint64_t count, offset, length, end;
+    uint32_t cipher_index, r;
+    unsigned long nthreads, ngen, nacc, nonces, key_suffix;
+    unsigned int n;
+    bool bind, have_offset, extend;
     struct timespec wall;
     double dwall;
+    int opt;
 
-    if (argc != 3)
-    {
-        fprintf(stderr, "usage: %s cipher key-count\n", argv[0]);
-        goto list_ciphers;
-    }
+    nthreads = 1;
+    offset = 0;
+    have_offset = false;
+    length = 0;
+    nonces = 0;
+    key_suffix = 0;
+    bind = false;
+    extend = false;
+    impl_spec = getenv(CIPHER_IMPL_ENV);
+    while ((opt = getopt(argc, argv, "bf:Hi:j:l:n:o:p:x")) != -1)
+        switch (opt)
+        {
+        case 'b':
+            bind = true;
+            break;
+
+        case 'f':
+            key_suffix = strtoul(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || key_suffix == 0
+                || key_suffix > MAX_KEY_SUFFIX)
+                errx(2, "key suffix '%s' is not an integer in [1, %d]",
+                     optarg, MAX_KEY_SUFFIX);
+            break;
+
+        case 'H':
+            page_alloc_use_huge = false;
+            break;
+
+        case 'i':
+            impl_spec = optarg;
+            break;
+
+        case 'j':
+            nthreads = strtoul(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || nthreads == 0
+                || nthreads > 1024)
+                errx(2, "thread count '%s' is not an integer in [1, 1024]",
+                     optarg);
+            break;
+
+        case 'l':
+            length = strtoumax(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || length == 0
+                || length % KEYSTREAM_GRANULE)
+                errx(2, "keystream length '%s' is not a positive multiple"
+                     " of %lu", optarg, KEYSTREAM_GRANULE);
+            break;
+
+        case 'n':
+            nonces = strtoul(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0' || nonces == 0
+                || nonces > UINT16_MAX + 1)
+                errx(2, "nonce count '%s' is not an integer in [1, %u]",
+                     optarg, UINT16_MAX + 1);
+            break;
+
+        case 'o':
+            offset = strtoumax(optarg, &endp, 10);
+            if (endp == optarg || *endp != '\0')
+                errx(2, "keystream offset '%s' is not a nonnegative integer",
+                     optarg);
+            have_offset = true;
+            break;
+
+        case 'p':
+            ngen = strtoul(optarg, &endp, 10);
+            nacc = 0;
+            if (endp != optarg && *endp == ',')
+                nacc = strtoul(endp + 1, &endp, 10);
+            if (*endp != '\0' || ngen == 0 || ngen > 64
+                || nacc == 0 || nacc > 64)
+                errx(2, "pipeline shape '%s' is not GEN,ACC with both"
+                     " in [1, 64]", optarg);
+            gen_threads = ngen;
+            acc_threads = nacc;
+            break;
+
+        case 'x':
+            extend = true;
+            break;
+
+        default:
+            goto usage;
+        }
 
+    if (argc - optind != 2)
+        goto usage;
+
+    cipher_name = argv[optind];
     for (cipher_index = 0; all_ciphers[cipher_index]; cipher_index++)
-        if (!strcmp(all_ciphers[cipher_index]->name, argv[1]))
+        if (!strcmp(all_ciphers[cipher_index]->name, cipher_name))
             break;
     if (!all_ciphers[cipher_index])
     {
-        fprintf(stderr, "%s: unrecognized cipher: %s\n", argv[0], argv[1]);
+        fprintf(stderr, "%s: unrecognized cipher: %s\n",
+                argv[0], cipher_name);
         goto list_ciphers;
     }
 
-    count = strtoumax(argv[2], &endp, 10);
-    if (endp == argv[2] || *endp != '\0' || count == 0)
-        errx(2, "key count '%s' is not a positive integer", argv[2]);
+    count = strtoumax(argv[optind+1], &endp, 10);
+    if (endp == argv[optind+1] || *endp != '\0' || (count == 0 && !extend))
+        errx(2, "key count '%s' is not a positive integer", argv[optind+1]);
+
+    if (impl_spec && !cipher_use_impls(impl_spec))
+        return 2;
 
     dataset_name = 0;
-    if (asprintf(&dataset_name, "results/%s.hdf", argv[1]) < 0)
+    if (asprintf(&dataset_name, "results/%s.hdf", cipher_name) < 0)
         err(2, "forming dataset name");
 
     if (dataset_read(dataset_name, &data))
@@ -104,42 +435,100 @@ main(int argc, char **argv)
                 dataset_name,
                 all_ciphers[cipher_index]->name,
                 all_ciphers[data.cipher_index]->name);
+        if (have_offset && offset != data.offset)
+            errx(1, "dataset %s: keystream offset is %"PRIu64", not %"PRIu64,
+                 dataset_name, data.offset, offset);
+        if (length && length > data.length && extend)
+            dataset_extend(&data, length);
+        else if (length && length != data.length)
+            errx(1, "dataset %s: keystream length is %"PRIu64", not %"PRIu64,
+                 dataset_name, data.length, length);
+        if (nonces && nonces != data.nonces)
+            errx(1, "dataset %s: nonce count is %"PRIu32", not %lu",
+                 dataset_name, data.nonces, nonces);
+        if (key_suffix && key_suffix != data.key_suffix)
+            errx(1, "dataset %s: key suffix is %"PRIu32", not %lu",
+                 dataset_name, data.key_suffix, key_suffix);
     }
     else
     {
+        dataset_alloc(&data, length ? length : DEFAULT_KEYSTREAM_LENGTH);
         data.highest_key = 0;
         data.cipher_index = cipher_index;
+        data.nonces = nonces ? nonces : 1;
+        data.key_suffix = key_suffix;
+        data.offset = offset;
     }
+    if (data.nonces > 1 && !all_ciphers[cipher_index]->set_nonce)
+        errx(2, "cipher %s does not take a nonce", cipher_name);
 
-    base  = data.highest_key;
-    limit = base + count;
-
-    clock_gettime(CLOCK_MONOTONIC, &wall);
-
-    while (base < limit)
+    threads = calloc(nthreads, sizeof(worker_thread));
+    if (!threads)
+        err(1, "memory allocation failure");
+    for (n = 0; n < nthreads; n++)
     {
-        wo.cipher_index = data.cipher_index;
-        wo.base = base;
-        if (base + UINT16_MAX > limit)
-            wo.limit = limit;
-        else
-            wo.limit = base + UINT16_MAX + 1;
+        threads[n].data = &data;
+        threads[n].all = threads;
+        threads[n].nthreads = nthreads;
+    }
+    place_threads(threads, nthreads, bind);
+    slice_rows(threads, nthreads, 0, data.length);
+    fprintf(stderr, "dataset: %s; worker histograms: %s; scatter: %s;"
+            " cipher: %s/%s\n",
+            page_kind_name(data.pages), page_kind_name(threads[0].wr.pages),
+            scatter_select()->name,
+            cipher_name, cipher_impl_name(all_ciphers[cipher_index]));
 
+    clock_gettime(CLOCK_MONOTONIC, &wall);
 
-        worker_run(&wo, &wr);
-        update_dataset(&data, &wr);
-        base = wo.limit;
+    /* Rows added by extending the dataset are missing the keys that
+       came before.  A counter-mode cipher can start anywhere in the
+       keystream, so those keys can be run over just the new rows.
+       Any other cipher would have to generate everything before them
+       again, for every key, so its regions are left as they are and
+       the new rows simply have fewer samples.  */
+    if (all_ciphers[cipher_index]->gen_blocks)
+        for (;;)
+        {
+            for (r = data.nregions; r > 0 && !data.region_key[r-1]; r--)
+                ;
+            if (r-- == 0)
+                break;
+            end = r + 1 < data.nregions ? data.region_row[r+1] : data.length;
+            fprintf(stderr, "filling in rows %"PRIu64"--%"PRIu64"\n",
+                    data.region_row[r], end - 1);
+            run_keys(threads, nthreads, &data, 0, data.region_key[r],
+                     data.region_row[r], end - data.region_row[r],
+                     bind, &wall);
+            dataset_set_region_key(&data, r, 0);
+        }
+    else
+        for (r = 1; r < data.nregions; r++)
+            fprintf(stderr, "rows %"PRIu64" on: samples from key %"PRIu64
+                    " on only\n", data.region_row[r], data.region_key[r]);
 
-        dwall = interval(CLOCK_MONOTONIC, &wall);
-        fprintf(stderr, "%"PRIu64"--%"PRIu64": %9.5fs\n",
-                wo.base, wo.limit-1, dwall);
-    }
-    data.highest_key = limit;
+    run_keys(threads, nthreads, &data, data.highest_key,
+             data.highest_key + count, 0, data.length, bind, &wall);
+    data.highest_key += count;
     dataset_write(dataset_name, &data);
     dwall = interval(CLOCK_MONOTONIC, &wall);
     fprintf(stderr, "checkpoint: %9.5fs\n", dwall);
+
+    for (n = 0; n < nthreads; n++)
+        work_results_free(&threads[n].wr);
+    free(threads);
+    if (bind)
+        topology_free(&topo);
+    dataset_free(&data);
     return 0;
 
+    usage:
+        fprintf(stderr,
+                "usage: %s [-bH] [-f key-suffix] [-i impls] [-j threads]"
+                " [-l length]\n"
+                "       [-n nonces] [-o offset] [-p gen,acc] [-x]"
+                " cipher key-count\n",
+                argv[0]);
     list_ciphers:
         fputs("supported ciphers:", stderr);
         for (int i = 0; all_ciphers[i]; i++)
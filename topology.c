@@ -0,0 +1,188 @@
+/*
+ *  RNGstats: processor topology and thread placement.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include "topology.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Parse a kernel CPU list such as "0-3,8-11" from F, and set the
+   corresponding entries of NODE_OF to NODE.  */
+static void
+read_cpulist(FILE *f, int *node_of, int node)
+{
+    int lo, hi, c;
+
+    for (;;)
+    {
+        if (fscanf(f, "%d", &lo) != 1)
+            return;
+        hi = lo;
+        c = getc(f);
+        if (c == '-')
+        {
+            if (fscanf(f, "%d", &hi) != 1)
+                return;
+            c = getc(f);
+        }
+        for (; lo <= hi; lo++)
+            if (lo >= 0 && lo < CPU_SETSIZE)
+                node_of[lo] = node;
+        if (c != ',')
+            return;
+    }
+}
+
+void
+topology_read(topology *t)
+{
+    cpu_set_t allowed;
+    int node_of[CPU_SETSIZE];
+    int dense[CPU_SETSIZE];
+    char path[64];
+    FILE *f;
+    int c, node, maxnode;
+    unsigned int i;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed))
+        err(1, "sched_getaffinity");
+
+    maxnode = 0;
+    for (c = 0; c < CPU_SETSIZE; c++)
+        node_of[c] = 0;
+    for (node = 0; node < CPU_SETSIZE; node++)
+    {
+        snprintf(path, sizeof path,
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        f = fopen(path, "r");
+        if (!f)
+        {
+            /* Node numbers can have gaps, but not big ones.  */
+            if (node > maxnode + 64)
+                break;
+            continue;
+        }
+        read_cpulist(f, node_of, node);
+        fclose(f);
+        maxnode = node;
+    }
+
+    /* Renumber the nodes that have allowed CPUs densely.  */
+    for (node = 0; node <= maxnode; node++)
+        dense[node] = -1;
+    t->ncpus = CPU_COUNT(&allowed);
+    t->nnodes = 0;
+    t->cpu = malloc(t->ncpus * sizeof *t->cpu);
+    t->node = malloc(t->ncpus * sizeof *t->node);
+    if (!t->cpu || !t->node)
+        err(1, "memory allocation failure");
+
+    i = 0;
+    for (node = 0; node <= maxnode; node++)
+        for (c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed) && node_of[c] == node)
+            {
+                if (dense[node] == -1)
+                    dense[node] = t->nnodes++;
+                t->cpu[i] = c;
+                t->node[i] = dense[node];
+                i++;
+            }
+}
+
+void
+topology_free(topology *t)
+{
+    free(t->cpu);
+    free(t->node);
+    t->cpu = 0;
+    t->node = 0;
+    t->ncpus = t->nnodes = 0;
+}
+
+unsigned int
+topology_place(const topology *t, unsigned int n, unsigned int nworkers)
+{
+    unsigned int first, count, i, node, before;
+
+    /* Worker N goes on the node whose share of the CPUs, laid end to
+       end, covers the fraction N/NWORKERS.  */
+    i = (unsigned int)((unsigned long long)n * t->ncpus / nworkers);
+    node = t->node[i];
+
+    for (first = 0; t->node[first] != node; first++)
+        ;
+    for (count = 0; first + count < t->ncpus
+             && t->node[first + count] == node; count++)
+        ;
+
+    /* Number of workers placed on this node before N.  */
+    before = n - (unsigned int)(((unsigned long long)first * nworkers
+                                 + t->ncpus - 1) / t->ncpus);
+    return first + before % count;
+}
+
+void
+bind_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    int rv;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    rv = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (rv)
+    {
+        errno = rv;
+        err(1, "binding to cpu %d", cpu);
+    }
+}
+
+void
+bind_to_node(const topology *t, unsigned int node)
+{
+    cpu_set_t set;
+    unsigned int i;
+    int rv;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < t->ncpus; i++)
+        if (t->node[i] == node)
+            CPU_SET(t->cpu[i], &set);
+    rv = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (rv)
+    {
+        errno = rv;
+        err(1, "binding to node %u", node);
+    }
+}
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
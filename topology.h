@@ -0,0 +1,64 @@
+/*
+ *  RNGstats: processor topology and thread placement.
+ *  Copyright 2013 Zack Weinberg <zackw@panix.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TOPOLOGY_H__
+#define TOPOLOGY_H__
+
+/* The CPUs this process is allowed to run on, sorted by NUMA node
+   and then by CPU number.  The node numbers are renumbered densely
+   from zero.  Without NUMA information, everything is node 0.  */
+typedef struct
+{
+    unsigned int ncpus;
+    unsigned int nnodes;
+    int *cpu;
+    unsigned int *node;
+}
+topology;
+
+/* Fill in T from the current process's affinity mask and
+   /sys/devices/system/node.  Failure terminates the program.  */
+extern void topology_read(topology *t);
+extern void topology_free(topology *t);
+
+/* Choose a slot in T for worker N out of NWORKERS.  Workers are
+   divided into contiguous runs, one run per node, in proportion to
+   the number of CPUs on each node; within a node, workers are packed
+   onto consecutive CPUs (wrapping around if there are more workers
+   than CPUs).  Returns an index into T->cpu and T->node.  */
+extern unsigned int topology_place(const topology *t,
+                                   unsigned int n, unsigned int nworkers);
+
+/* Restrict the calling thread to run only on CPU.  Failure
+   terminates the program.  */
+extern void bind_to_cpu(int cpu);
+
+/* Restrict the calling thread to run only on the CPUs in T that
+   belong to NODE.  Failure terminates the program.  */
+extern void bind_to_node(const topology *t, unsigned int node);
+
+#endif
+
+/*
+ * Local Variables:
+ * indent-tabs-mode: nil
+ * c-basic-offset: 4
+ * c-file-offsets: ((substatement-open . 0))
+ * End:
+ */
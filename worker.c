@@ -19,7 +19,17 @@
 
 #include "worker.h"
 #include "ciphers.h"
+#include "ciphertab.h"
+#include "ciphers/contexts.h"
+#include "scatter.h"
+#include "spsc.h"
 
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* Nothing up my sleeve: first 32 hexadecimal digits of pi, as
@@ -31,45 +41,567 @@ static const uint8_t keygen_key[16] = {
     0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34
 };
 
-#define BLOCKSIZE 8192
-_Static_assert(KEYSTREAM_LENGTH % BLOCKSIZE == 0,
-               "keystream length must be a multiple of blocksize");
+/* Rather than running each key over the entire keystream in turn,
+   which would stream all of work_results.epmf through the cache once
+   per key, we process keys in batches of KEY_BATCH, and walk the
+   keystream in tiles of TILE_LENGTH positions.  For each tile, we
+   generate that stretch of keystream for every key in the batch, and
+   then fold all of it into the corresponding rows of epmf, which are
+   only TILE_LENGTH KiB and therefore stay in L2 the whole time.
+   The batch keystream is position-major, so each row of epmf takes
+   all of its increments from the batch consecutively.
+
+   Counting straight out of each cipher's registers, without going
+   through the 8 KiB tile buffer, is not worth a per-cipher entry
+   point: the buffer never leaves L1, and with the batch kernels
+   generating the keystream is under a fifth of the time.  Nearly
+   all the rest is the increments themselves, which a fused kernel
+   would still have to make, and without scatter's kernels.  */
+#define KEY_BATCH   32
+#define TILE_LENGTH 256
+_Static_assert(KEYSTREAM_GRANULE % TILE_LENGTH == 0,
+               "keystream granule must be a multiple of tile length");
+_Static_assert(TILE_LENGTH % SCATTER_ROWS == 0,
+               "tile length must be a multiple of the scatter row count");
+_Static_assert(COUNTER_KEYS >= KEY_BATCH,
+               "histogram counters too narrow for one batch of keys");
+
+/* Add rows BASE through BASE+TILE_LENGTH-1 of COUNTS into the totals,
+   and clear them.  */
+static inline void
+spill_tile(work_results *out, hist_counter (*counts)[256], uint64_t base)
+{
+    uint64_t k, c;
+    for (k = base; k < base + TILE_LENGTH; k++)
+    {
+        for (c = 0; c < 256; c++)
+            out->epmf[k][c] += counts[k][c];
+        memset(counts[k], 0, sizeof counts[k]);
+    }
+}
 
 void
-worker_run(const work_order *in, work_results *out)
+work_results_alloc(work_results *wr, uint64_t length)
 {
-    const cipher *ciph = all_ciphers[in->cipher_index];
-    uint64_t i, j, k;
-    uint8_t stream_block[BLOCKSIZE];
+    wr->length = length;
+    wr->epmf = page_alloc(length * sizeof *wr->epmf, &wr->pages);
+}
+
+void
+work_results_free(work_results *wr)
+{
+    page_free(wr->epmf, wr->length * sizeof *wr->epmf, wr->pages);
+    wr->length = 0;
+    wr->epmf = 0;
+}
+
+/* Derive the NKEYS keys starting at key index BASE for CIPH, into
+   KEYS.  aes128_cipher runs in counter mode, so asking for keystream
+   from i * ciph->keysize through (i+1)*ciph->keysize produces the
+   encipherment of 000... || i when ciph is a 128-bit cipher, and of
+   000... || 2i || 000... || 2i+1 when ciph is 256-bit.  Either way,
+   we'll never reuse keys within or between workers, but each key
+   should be satisfactorily random.  Consecutive keys are consecutive
+   stretches of keystream, and every key size is a whole number of
+   AES blocks, so any number of them can be derived with a single
+   gen_blocks call, which keeps the counter-mode bulk path busy.  */
+static inline void
+derive_keys(void *keygen_ctx, const cipher *ciph,
+            uint64_t base, uint64_t nkeys, uint8_t *keys)
+{
+    uint64_t per_key = ciph->keysize / aes128_cipher.blocksize;
+
+    aes128_cipher.gen_blocks(keygen_ctx, base * per_key, nkeys * per_key,
+                             keys);
+}
+
+/* The same, for the key families of work_order.key_suffix.  Each
+   family's shared prefix is derived once.  */
+static inline void
+derive_family_keys(void *keygen_ctx, const cipher *ciph, uint32_t suffix,
+                   uint64_t base, uint64_t nkeys, uint8_t *keys)
+{
+    size_t ks = ciph->keysize;
+    uint8_t prefix[ks];
+    uint64_t k;
+    uint32_t b;
+
+    if (!suffix)
+    {
+        derive_keys(keygen_ctx, ciph, base, nkeys, keys);
+        return;
+    }
+
+    for (k = base; k < base + nkeys; k++, keys += ks)
+    {
+        if (k == base || (k >> (8 * suffix)) << (8 * suffix) == k)
+            derive_keys(keygen_ctx, ciph, k >> (8 * suffix), 1, prefix);
+        memcpy(keys, prefix, ks - suffix);
+        for (b = 0; b < suffix; b++)
+            keys[ks - 1 - b] = (uint8_t)(k >> (8 * b));
+    }
+}
+
+/* The number of keys in the batch starting at key I of IN: at most
+   KEY_BATCH, and never straddling two key families, so that all of a
+   batch's keys share their prefix.  */
+static inline uint64_t
+batch_size(const work_order *in, uint64_t i)
+{
+    uint64_t n = in->limit - i, family_end;
+
+    if (n > KEY_BATCH)
+        n = KEY_BATCH;
+    if (in->key_suffix)
+    {
+        family_end = ((i >> (8 * in->key_suffix)) + 1)
+            << (8 * in->key_suffix);
+        if (n > family_end - i)
+            n = family_end - i;
+    }
+    return n;
+}
 
-    uint8_t keygen_ctx[aes128_cipher.ctxsize];
-    uint8_t stream_ctx[ciph->ctxsize];
-    uint8_t stream_key[ciph->keysize];
+/* The length of the prefix shared by the keys of any one batch.  */
+static inline size_t
+shared_prefix(const cipher *ciph, const work_order *in)
+{
+    return in->key_suffix ? ciph->keysize - in->key_suffix : 0;
+}
+
+/* The body of worker_run.  It is instantiated once per cipher, below,
+   with CIPH a constant and STREAM_CTX an array of KEY_BATCH of its
+   contexts.  */
+static inline __attribute__((always_inline)) void
+run_with(const cipher *ciph, uint8_t *stream_ctx,
+         const work_order *in, work_results *out)
+{
+    uint64_t i, j, nkeys, unspilled;
+    uint32_t nonce;
+    bool spill;
+    hist_counter (*counts)[256];
+#if HISTOGRAM_COUNTER_BITS < 32
+    page_kind counts_pages;
+#endif
+    uint8_t stream_block[TILE_LENGTH * KEY_BATCH + SCATTER_PAD];
+    scatter_fn scatter = scatter_select()->fn;
+
+    aes_context keygen_ctx;
+    uint8_t *stream_keys;
+
+    if (in->length != out->length || in->length % KEYSTREAM_GRANULE
+        || in->nonces == 0 || (in->nonces > 1 && !ciph->set_nonce)
+        || in->key_suffix > MAX_KEY_SUFFIX)
+        abort();
+
+    memset(out->epmf, 0, out->length * sizeof *out->epmf);
+
+    /* An empty work order, which splitting a key range into unequal
+       parts can produce, adds nothing.  */
+    if (in->limit <= in->base)
+        return;
 
-    memset(out, 0, sizeof(work_results));
-    aes128_cipher.init(keygen_ctx, keygen_key);
+    /* Derive the keys for the whole work order up front.  */
+    stream_keys = malloc((in->limit - in->base) * ciph->keysize);
+    if (!stream_keys)
+        err(1, "memory allocation failure");
+    aes128_keygen_init(&keygen_ctx, keygen_key);
+    derive_family_keys(&keygen_ctx, ciph, in->key_suffix,
+                       in->base, in->limit - in->base, stream_keys);
 
-    for (i = in->base; i < in->limit; i++)
+#if HISTOGRAM_COUNTER_BITS == 32
+    counts = out->epmf;
+#else
+    counts = page_alloc(in->length * sizeof *counts, &counts_pages);
+#endif
+    unspilled = 0;
+
+    for (i = in->base; i < in->limit; i += nkeys)
     {
-        /* aes128_cipher runs in counter mode, so asking for keystream
-           from i * ciph->keysize through (i+1)*ciph->keysize produces
-           the encipherment of 000... || i when ciph is a 128-bit cipher,
-           and of 000... || 2i || 000... || 2i+1 when ciph is 256-bit.
-           Either way, we'll never reuse keys within or between workers,
-           but each key should be satisfactorily random. */
-        aes128_cipher.gen_keystream(keygen_ctx, i * ciph->keysize,
-                                    stream_key, ciph->keysize);
-
-        ciph->init(stream_ctx, stream_key);
-
-        for (j = 0; j < KEYSTREAM_LENGTH; j += BLOCKSIZE)
+        nkeys = batch_size(in, i);
+        cipher_init_batch_prefix(ciph, stream_ctx,
+                                 stream_keys + (i - in->base) * ciph->keysize,
+                                 nkeys, shared_prefix(ciph, in));
+
+        /* Each nonce makes another batch of samples from the same
+           contexts.  */
+        for (nonce = 0; nonce < in->nonces; nonce++)
         {
-            ciph->gen_keystream(stream_ctx, j, stream_block, BLOCKSIZE);
+            if (nonce)
+                cipher_set_nonce_batch(ciph, stream_ctx, nkeys, nonce);
+
+            /* Spill each tile right after this batch has been added
+               to it, if another full batch could overflow the
+               counters, or if this is the last batch.  */
+            unspilled += nkeys;
+            spill = (HISTOGRAM_COUNTER_BITS < 32 &&
+                     (unspilled + KEY_BATCH > COUNTER_KEYS ||
+                      (i + nkeys == in->limit &&
+                       nonce + 1 == in->nonces)));
+
+            for (j = 0; j < in->length; j += TILE_LENGTH)
+            {
+                cipher_gen_keystream_batch(ciph, stream_ctx, nkeys,
+                                           in->offset + j,
+                                           stream_block, TILE_LENGTH);
+                scatter(counts + j, stream_block, TILE_LENGTH, nkeys);
 
-            for (k = 0; k < BLOCKSIZE; k++)
-                out->epmf[j+k][stream_block[k]] += 1;
+                if (spill)
+                    spill_tile(out, counts, j);
+            }
+
+            if (spill)
+                unspilled = 0;
         }
     }
+
+    free(stream_keys);
+#if HISTOGRAM_COUNTER_BITS < 32
+    page_free(counts, in->length * sizeof *counts, counts_pages);
+#endif
+}
+
+/* Pipelined mode.  The calling thread derives keys, a batch at a
+   time, and deals the batches out round-robin to the generator
+   threads.  Each generator initializes a batch of contexts and, for
+   each nonce, walks the keystream a tile at a time, as worker_run
+   does, but instead of accumulating each tile itself, it writes it
+   straight into a slot of a ring leading to the accumulator thread
+   that owns that tile.  Each accumulator owns a contiguous slice of
+   the tiles, and so of the rows of the histogram, and drains one
+   ring from every generator.  A slot with NKEYS == 0 marks the end
+   of the work order.
+
+   Since each accumulator is the only writer of its rows, and the
+   spill decision is made per tile from the number of keys actually
+   added to it, the result is exactly the same as worker_run's, no
+   matter what order the batches arrive in.  */
+
+#define MAX_KEYSIZE      32
+#define KEY_RING_SLOTS    4
+#define STREAM_RING_SLOTS 8
+
+typedef struct
+{
+    uint64_t nkeys;
+    uint8_t keys[KEY_BATCH * MAX_KEYSIZE];
+} key_slot;
+
+typedef struct
+{
+    uint64_t pos;
+    uint64_t nkeys;
+    uint8_t stream_block[TILE_LENGTH * KEY_BATCH + SCATTER_PAD];
+} stream_slot;
+
+typedef struct
+{
+    scatter_fn scatter;
+    work_results *out;
+    hist_counter (*counts)[256];
+    uint64_t *unspilled;            /* keys added to each tile */
+    uint64_t offset;
+    uint64_t ntiles;
+    uint32_t nonces;
+    size_t prefix;
+    unsigned int ngen;
+    unsigned int nacc;
+    spsc_ring *key_rings;           /* [ngen] */
+    spsc_ring *stream_rings;        /* [ngen][nacc] */
+} pipeline;
+
+typedef struct
+{
+    pthread_t thread;
+    pipeline *p;
+    unsigned int index;
+} stage_thread;
+
+/* The first tile owned by accumulator A.  */
+static inline uint64_t
+first_tile(const pipeline *p, unsigned int a)
+{
+    return p->ntiles * a / p->nacc;
+}
+
+/* The generator stage, instantiated per cipher like run_with.  */
+static inline __attribute__((always_inline)) void *
+generate_with(const cipher *ciph, uint8_t *stream_ctx, void *arg)
+{
+    const stage_thread *t = arg;
+    pipeline *p = t->p;
+    spsc_ring *keys = &p->key_rings[t->index];
+    spsc_ring *streams = &p->stream_rings[t->index * p->nacc];
+    const key_slot *ks;
+    stream_slot *ss;
+    uint64_t nkeys, tile;
+    uint32_t nonce;
+    unsigned int a;
+
+    for (;;)
+    {
+        ks = spsc_peek(keys);
+        if (!ks)
+        {
+            sched_yield();
+            continue;
+        }
+        nkeys = ks->nkeys;
+        if (nkeys)
+            cipher_init_batch_prefix(ciph, stream_ctx, ks->keys, nkeys,
+                                     p->prefix);
+        spsc_release(keys);
+        if (!nkeys)
+            break;
+
+        for (nonce = 0; nonce < p->nonces; nonce++)
+        {
+            if (nonce)
+                cipher_set_nonce_batch(ciph, stream_ctx, nkeys, nonce);
+            for (a = 0; a < p->nacc; a++)
+                for (tile = first_tile(p, a); tile < first_tile(p, a+1);
+                     tile++)
+                {
+                    ss = spsc_claim(&streams[a]);
+                    ss->pos = tile * TILE_LENGTH;
+                    ss->nkeys = nkeys;
+                    cipher_gen_keystream_batch(ciph, stream_ctx, nkeys,
+                                               p->offset + ss->pos,
+                                               ss->stream_block,
+                                               TILE_LENGTH);
+                    spsc_publish(&streams[a]);
+                }
+        }
+    }
+
+    for (a = 0; a < p->nacc; a++)
+    {
+        ss = spsc_claim(&streams[a]);
+        ss->nkeys = 0;
+        spsc_publish(&streams[a]);
+    }
+    return 0;
+}
+
+static void *
+accumulate_stage(void *arg)
+{
+    const stage_thread *t = arg;
+    pipeline *p = t->p;
+    uint64_t lo = first_tile(p, t->index), hi = first_tile(p, t->index + 1);
+    uint64_t tile;
+    unsigned int g, running;
+    bool progress, done[p->ngen];
+    spsc_ring *r;
+    const stream_slot *ss;
+
+    /* First touch of this slice of the histogram is by its owner.  */
+    memset(p->out->epmf[lo * TILE_LENGTH], 0,
+           (hi - lo) * TILE_LENGTH * sizeof *p->out->epmf);
+
+    memset(done, 0, sizeof done);
+    running = p->ngen;
+    while (running)
+    {
+        progress = false;
+        for (g = 0; g < p->ngen; g++)
+        {
+            if (done[g])
+                continue;
+            r = &p->stream_rings[g * p->nacc + t->index];
+            ss = spsc_peek(r);
+            if (!ss)
+                continue;
+
+            progress = true;
+            if (!ss->nkeys)
+            {
+                done[g] = true;
+                running--;
+            }
+            else
+            {
+                p->scatter(p->counts + ss->pos, ss->stream_block,
+                           TILE_LENGTH, ss->nkeys);
+                tile = ss->pos / TILE_LENGTH;
+                p->unspilled[tile] += ss->nkeys;
+                if (HISTOGRAM_COUNTER_BITS < 32 &&
+                    p->unspilled[tile] + KEY_BATCH > COUNTER_KEYS)
+                {
+                    spill_tile(p->out, p->counts, ss->pos);
+                    p->unspilled[tile] = 0;
+                }
+            }
+            spsc_release(r);
+        }
+        if (!progress)
+            sched_yield();
+    }
+
+    if (HISTOGRAM_COUNTER_BITS < 32)
+        for (tile = lo; tile < hi; tile++)
+            if (p->unspilled[tile])
+                spill_tile(p->out, p->counts, tile * TILE_LENGTH);
+    return 0;
+}
+
+/* Each cipher gets its own copy of worker_run and of the generator
+   stage, in which the cipher's dispatch structure is a constant.
+   Link-time optimization can then turn the calls through it into
+   direct calls and inline them into the tile loop.  The array of
+   contexts is declared here, where the cipher's context type, and so
+   its size, is known at compile time.  */
+typedef struct
+{
+    void (*run)(const work_order *in, work_results *out);
+    void *(*generate)(void *arg);
+}
+worker_instance;
+
+#define WORKER_INSTANCE(name, prefix)                               \
+    static void                                                     \
+    run_##name(const work_order *in, work_results *out)             \
+    {                                                               \
+        uint8_t stream_ctx[KEY_BATCH * sizeof(prefix##_context)]    \
+            __attribute__((aligned(64)));                           \
+        run_with(&name##_cipher, stream_ctx, in, out);              \
+    }                                                               \
+    static void *                                                   \
+    generate_##name(void *arg)                                      \
+    {                                                               \
+        uint8_t stream_ctx[KEY_BATCH * sizeof(prefix##_context)]    \
+            __attribute__((aligned(64)));                           \
+        return generate_with(&name##_cipher, stream_ctx, arg);      \
+    }
+FOR_EACH_CIPHER(WORKER_INSTANCE)
+#undef WORKER_INSTANCE
+
+/* Indexed like all_ciphers.  */
+#define WORKER_ENTRY(name, prefix) { run_##name, generate_##name },
+static const worker_instance worker_instances[] = {
+    FOR_EACH_CIPHER(WORKER_ENTRY)
+};
+#undef WORKER_ENTRY
+
+void
+worker_run(const work_order *in, work_results *out)
+{
+    worker_instances[in->cipher_index].run(in, out);
+}
+
+static void
+start_stage(stage_thread *t, void *(*fn)(void *))
+{
+    int rv = pthread_create(&t->thread, 0, fn, t);
+    if (rv)
+    {
+        errno = rv;
+        err(1, "pthread_create");
+    }
+}
+
+static void
+join_stage(stage_thread *t)
+{
+    int rv = pthread_join(t->thread, 0);
+    if (rv)
+    {
+        errno = rv;
+        err(1, "pthread_join");
+    }
+}
+
+void
+worker_run_pipelined(const work_order *in, work_results *out,
+                     unsigned int gen_threads, unsigned int acc_threads)
+{
+    const cipher *ciph = all_ciphers[in->cipher_index];
+    void *(*generate)(void *) = worker_instances[in->cipher_index].generate;
+    pipeline p;
+    stage_thread gens[gen_threads], accs[acc_threads];
+    aes_context keygen_ctx;
+    uint64_t i, nkeys, batch;
+    unsigned int n;
+    key_slot *ks;
+#if HISTOGRAM_COUNTER_BITS < 32
+    page_kind counts_pages;
+#endif
+
+    if (in->length != out->length || in->length % KEYSTREAM_GRANULE
+        || in->nonces == 0 || (in->nonces > 1 && !ciph->set_nonce)
+        || in->key_suffix > MAX_KEY_SUFFIX
+        || ciph->keysize > MAX_KEYSIZE || !gen_threads || !acc_threads)
+        abort();
+
+    aes128_keygen_init(&keygen_ctx, keygen_key);
+
+    p.scatter = scatter_select()->fn;
+    p.out = out;
+    p.offset = in->offset;
+    p.ntiles = in->length / TILE_LENGTH;
+    p.nonces = in->nonces;
+    p.prefix = shared_prefix(ciph, in);
+    p.ngen = gen_threads;
+    p.nacc = acc_threads;
+#if HISTOGRAM_COUNTER_BITS == 32
+    p.counts = out->epmf;
+#else
+    p.counts = page_alloc(in->length * sizeof *p.counts, &counts_pages);
+#endif
+    p.unspilled = calloc(p.ntiles, sizeof *p.unspilled);
+    p.key_rings = malloc(p.ngen * sizeof *p.key_rings);
+    p.stream_rings = malloc(p.ngen * p.nacc * sizeof *p.stream_rings);
+    if (!p.unspilled || !p.key_rings || !p.stream_rings)
+        err(1, "memory allocation failure");
+    for (n = 0; n < p.ngen; n++)
+        spsc_init(&p.key_rings[n], KEY_RING_SLOTS, sizeof(key_slot));
+    for (n = 0; n < p.ngen * p.nacc; n++)
+        spsc_init(&p.stream_rings[n], STREAM_RING_SLOTS, sizeof(stream_slot));
+
+    for (n = 0; n < p.nacc; n++)
+    {
+        accs[n].p = &p;
+        accs[n].index = n;
+        start_stage(&accs[n], accumulate_stage);
+    }
+    for (n = 0; n < p.ngen; n++)
+    {
+        gens[n].p = &p;
+        gens[n].index = n;
+        start_stage(&gens[n], generate);
+    }
+
+    for (i = in->base, batch = 0; i < in->limit; i += nkeys, batch++)
+    {
+        nkeys = batch_size(in, i);
+        ks = spsc_claim(&p.key_rings[batch % p.ngen]);
+        ks->nkeys = nkeys;
+        derive_family_keys(&keygen_ctx, ciph, in->key_suffix,
+                           i, nkeys, ks->keys);
+        spsc_publish(&p.key_rings[batch % p.ngen]);
+    }
+    for (n = 0; n < p.ngen; n++)
+    {
+        ks = spsc_claim(&p.key_rings[n]);
+        ks->nkeys = 0;
+        spsc_publish(&p.key_rings[n]);
+    }
+
+    for (n = 0; n < p.ngen; n++)
+        join_stage(&gens[n]);
+    for (n = 0; n < p.nacc; n++)
+        join_stage(&accs[n]);
+
+    for (n = 0; n < p.ngen * p.nacc; n++)
+        spsc_free(&p.stream_rings[n]);
+    for (n = 0; n < p.ngen; n++)
+        spsc_free(&p.key_rings[n]);
+    free(p.stream_rings);
+    free(p.key_rings);
+    free(p.unspilled);
+#if HISTOGRAM_COUNTER_BITS < 32
+    page_free(p.counts, in->length * sizeof *p.counts, counts_pages);
+#endif
 }
 
 /*
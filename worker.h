@@ -21,8 +21,11 @@
 #define WORKERS_H__
 
 #include "config.h"
+#include "pagealloc.h"
 #include <stdint.h>
 
+#define MAX_KEY_SUFFIX 4
+
 /* Data input to each worker, telling it what to do. */
 typedef struct
 {
@@ -30,18 +33,54 @@ typedef struct
     uint64_t base;
     uint64_t limit;
 
+    /* Analyze keystream positions OFFSET through OFFSET+LENGTH-1;
+       row I of the histogram counts position OFFSET+I.  Ciphers that
+       can't seek run through everything before OFFSET, for each key,
+       without producing output.  */
+    uint64_t offset;
+    uint64_t length;
+
+    /* Run each key with nonces 0 through NONCES-1, counting each as a
+       separate sample, so the key is only set up once for all of
+       them.  This must be 1 for ciphers without set_nonce.  */
+    uint32_t nonces;
+
+    /* If nonzero, keys come in families of 256^KEY_SUFFIX that share
+       all but their last KEY_SUFFIX bytes, which enumerate every
+       value: key I is the key that I >> 8*KEY_SUFFIX would be
+       otherwise, with its last KEY_SUFFIX bytes replaced by the low
+       bytes of I, big-endian.  At most MAX_KEY_SUFFIX.  */
+    uint32_t key_suffix;
+
     /* Operate on the cipher at this index in all_ciphers.  */
     uint32_t cipher_index;
 } work_order;
 
-/* Data output from each worker. */
+/* Data output from each worker.  EPMF has LENGTH rows, which must
+   match the work order.  */
 typedef struct
 {
-    uint32_t epmf[KEYSTREAM_LENGTH][256];
+    uint64_t length;
+    uint32_t (*epmf)[256];
+    page_kind pages;
 } work_results;
 
+/* Allocate (or free) the histogram in WR, for keystream length
+   LENGTH.  Allocation failure terminates the program.  */
+extern void work_results_alloc(work_results *wr, uint64_t length);
+extern void work_results_free(work_results *wr);
+
 extern void worker_run(const work_order *in, work_results *out);
 
+/* Like worker_run, but run key derivation, keystream generation, and
+   histogram accumulation as separate pipeline stages: the calling
+   thread derives keys, GEN_THREADS threads generate keystream, and
+   ACC_THREADS threads accumulate it, each into its own slice of the
+   rows of OUT.  The results are identical to worker_run's.  */
+extern void worker_run_pipelined(const work_order *in, work_results *out,
+                                 unsigned int gen_threads,
+                                 unsigned int acc_threads);
+
 #endif
 
 /*